@@ -60,13 +60,22 @@ void tlb_write(uint32_t entryhi, uint32_t entrylo, uint32_t index);
 void tlb_read(uint32_t *entryhi, uint32_t *entrylo, uint32_t index);
 int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
+/*
+ *   tlb_setasid: load ASID in the PID field of c0_entryhi, so that only
+ *        TLB entries tagged with it (or global ones) match user
+ *        accesses. tlb_random, tlb_write, tlb_read and tlb_probe all
+ *        overwrite c0_entryhi, so call this again after using them.
+ */
+void tlb_setasid(uint32_t asid);
+
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
- * bits that aren't assigned a meaning.
+ * Note that the MIPS has support for a 6-bit address space ID. dumbvm
+ * tags user entries with the ASID of their address space (TLBHI_PID),
+ * so that entries of several address spaces can stay in the TLB across
+ * context switches. TLBLO_GLOBAL is left zero, as are the bits that
+ * aren't assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
  * ever set by the processor. If you set it, writes are permitted. If
@@ -78,7 +87,8 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -101,5 +111,11 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 #define NUM_TLB  64
 
+/*
+ * Number of address space IDs (values of TLBHI_PID).
+ */
+
+#define NUM_ASID 64
+
 
 #endif /* _MIPS_TLB_H_ */
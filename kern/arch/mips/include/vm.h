@@ -66,6 +66,7 @@
  * a valid address, and will make a *huge* mess if you scribble on it.
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
 
 /*
  * The top of user space. (Actually, the address immediately above the
@@ -116,11 +117,17 @@ paddr_t ram_getfirstfree(void);
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  */
 
+struct semaphore;
+
 struct tlbshootdown {
 	/*
-	 * Change this to what you need for your VM design.
+	 * dumbvm asks for a whole-TLB flush (see vm_evict) or, if
+	 * ts_asid is not 0, for the entries of that ASID to be made
+	 * read-only (see as_copy), and waits for each target to V
+	 * ts_done.
 	 */
-	int ts_placeholder;
+	struct semaphore *ts_done;
+	unsigned ts_asid;
 };
 
 #define TLBSHOOTDOWN_MAX 16
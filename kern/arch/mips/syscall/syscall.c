@@ -36,6 +36,7 @@
 #include <current.h>
 #include <syscall.h>
 #include <addrspace.h>
+#include <copyinout.h>
 
 /*
  * System call dispatcher.
@@ -109,6 +110,11 @@ void syscall(struct trapframe *tf)
 						 (userptr_t)tf->tf_a1);
 		break;
 
+	case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+							(userptr_t)tf->tf_a1);
+		break;
+
 /* Add stuff here */
 #if OPT_SYSCALLS
 
@@ -117,22 +123,15 @@ void syscall(struct trapframe *tf)
 		userptr_t u_to_write = (userptr_t)to_write;
 		sys_write(STDOUT_FILENO, u_to_write, 24);
 
-		long sys_write(int fd, userptr_t buf, size_t nbytes)
+		int sys_write(int fd, userptr_t buf, size_t nbytes, int32_t *retval)
 		*/
-		retval = sys_write((int)tf->tf_a0, (userptr_t)tf->tf_a1, (size_t)tf->tf_a2);
-		if (retval < 0)	  // Trying to write to real file
-			err = ENOSYS; /* errno.h Function not implemented */
-		else
-			err = 0;
-
+		err = sys_write((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+						(size_t)tf->tf_a2, &retval);
 		break;
 
 	case SYS_read:
-		retval = sys_read((int)tf->tf_a0, (userptr_t)tf->tf_a1, (size_t)tf->tf_a2);
-		if (retval < 0)	  // Trying to read from real file
-			err = ENOSYS; /* errno.h Function not implemented */
-		else
-			err = 0;
+		err = sys_read((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+					   (size_t)tf->tf_a2, &retval);
 		break;
 
 	case SYS__exit:
@@ -174,6 +173,60 @@ void syscall(struct trapframe *tf)
 		else
 			err = 0;
 		break;
+	case SYS_dup2:
+		err = sys_dup2((int)tf->tf_a0, (int)tf->tf_a1, &retval);
+		break;
+	case SYS_lseek:
+	{
+		/* pos is in a2/a3, whence on the user stack */
+		off_t pos, newpos;
+		int whence;
+
+		pos = ((off_t)tf->tf_a2 << 32) | (off_t)tf->tf_a3;
+		err = copyin((userptr_t)(tf->tf_sp + 16), &whence, sizeof(whence));
+		if (err)
+			break;
+		err = sys_lseek((int)tf->tf_a0, pos, whence, &newpos);
+		if (err)
+			break;
+		/* 64-bit return value: high word in v0, low word in v1 */
+		retval = (int32_t)(newpos >> 32);
+		tf->tf_v1 = (uint32_t)newpos;
+		break;
+	}
+	case SYS_readv:
+		err = sys_readv((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+						(int)tf->tf_a2, &retval);
+		break;
+	case SYS_writev:
+		err = sys_writev((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+						 (int)tf->tf_a2, &retval);
+		break;
+	case SYS_pread:
+	case SYS_pwrite:
+	case SYS_preadv:
+	case SYS_pwritev:
+	{
+		/* the 64-bit offset is aligned past a3, on the user stack */
+		off_t offset;
+
+		err = copyin((userptr_t)(tf->tf_sp + 16), &offset, sizeof(offset));
+		if (err)
+			break;
+		if (callno == SYS_pread)
+			err = sys_pread((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+							(size_t)tf->tf_a2, offset, &retval);
+		else if (callno == SYS_pwrite)
+			err = sys_pwrite((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+							 (size_t)tf->tf_a2, offset, &retval);
+		else if (callno == SYS_preadv)
+			err = sys_preadv((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+							 (int)tf->tf_a2, offset, &retval);
+		else
+			err = sys_pwritev((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+							  (int)tf->tf_a2, offset, &retval);
+		break;
+	}
 #endif
 #endif /* OPT_SYSCALLS */
 
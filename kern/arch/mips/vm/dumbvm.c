@@ -33,11 +33,27 @@
 #include <spl.h>
 #include <cpu.h>
 #include <spinlock.h>
+#include <synch.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include "opt-paging.h"
+#include "opt-swap.h"
+#include "opt-locks_semaphores.h"
+#include "opt-locks_wchans.h"
+#if OPT_PAGING
+#include <coremap.h>
+#include <pt.h>
+#endif
+#if OPT_SWAP
+#include <swapfile.h>
+#endif
+#if OPT_LAZY_ELF
+#include <uio.h>
+#include <vnode.h>
+#endif
 
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -89,62 +105,213 @@ dumbvm_can_sleep(void)
 /* -------------------------------------------------------------------------- */
 #include "opt-basic_vm_dealloc.h"
 
+#if OPT_PAGING && !OPT_BASIC_VM_DEALLOC
+#error "options paging requires options basic_vm_dealloc"
+#endif
+#if OPT_SWAP && !OPT_PAGING
+#error "options swap requires options paging"
+#endif
+#if OPT_LAZY_ELF && !OPT_PAGING
+#error "options lazy_elf requires options paging"
+#endif
+#if OPT_SWAP && !OPT_LOCKS_SEMAPHORES && !OPT_LOCKS_WCHANS
+#error "options swap requires working locks (locks_semaphores or locks_wchans)"
+#endif
+
+#if OPT_SWAP
+/*
+ * Serializes every change to user page tables (faults, copies,
+ * destruction) with eviction, which changes the page table of an
+ * address space that may be running on another cpu. Created by
+ * vm_bootstrap; until then nothing can be evicted.
+ */
+static struct lock *vm_lock = NULL;
+static struct semaphore *vm_shootdown_sem = NULL; /* protected by vm_lock */
+static paddr_t vm_reclaim(unsigned long npages);
+
+/*
+ * Every address space, so that vm_evict can find the one still mapping
+ * a frame that used to be shared. Protected by vm_lock.
+ */
+static struct addrspace *vm_aslist = NULL;
+#endif
+
 #define MEMORY_PROFILING 0
 
 #if OPT_BASIC_VM_DEALLOC
 
 /*  Kernel: kmalloc->alloc_kpages | User: as_prepare_load
-	Both call getppages, which calls ram_stealmem
+	Both call getppages, which calls ram_stealmem until vm_bootstrap runs
 
 	Kernel: kfree->free_kpages | User: as_destroy
 	Both call freeppages
 
-	getppages and freeppages coordinate through the freeRamFrames and allocSize array
+	vm_bootstrap hands all the remaining RAM to a binary buddy allocator:
+	free blocks of 2^order frames are kept in one list per order, so that
+	getppages and freeppages are O(log n), and freed buddies coalesce back
+	into large blocks (e.g. for the DUMBVM_STACKPAGES user stacks).
+
+	A request for npages is carved out of a block of order ceil(log2(npages)):
+	the unused tail goes back to the free lists at once, and the pages kept
+	are a chain of aligned power-of-two blocks, each one telling whether
+	another block of the same allocation follows it (BUDDY_CHAIN).
+	freeppages walks the chain, so no allocation size has to be stored.
 */
 static struct spinlock freemem_lock = SPINLOCK_INITIALIZER;
 
-static unsigned char *freeRamFrames = NULL;
-static unsigned long *allocSize = NULL;
+/* 2^17 frames = 512MB, the most ram_bootstrap will ever manage */
+#define BUDDY_MAX_ORDER 17
+
+/* frameInfo[i] describes frame i; only the first frame of a block is tagged */
+#define BUDDY_ORDER_MASK 0x1f
+#define BUDDY_CHAIN 0x20 /* another block of the same allocation follows */
+#define BUDDY_USED 0x40	 /* first frame of an allocated block */
+#define BUDDY_FREE 0x80	 /* first frame of a free block */
+
+/* Free blocks are linked through their own first page */
+struct buddy_block
+{
+	struct buddy_block *next;
+	struct buddy_block *prev;
+};
+
+#define FRAME_TO_BLOCK(f) ((struct buddy_block *)PADDR_TO_KVADDR((paddr_t)(f) * PAGE_SIZE))
+#define BLOCK_TO_FRAME(b) ((long)(((vaddr_t)(b)-MIPS_KSEG0) / PAGE_SIZE))
+
+static unsigned char *frameInfo = NULL;
+static struct buddy_block *freeLists[BUDDY_MAX_ORDER + 1];
+static unsigned long nFreeBlocks[BUDDY_MAX_ORDER + 1];
+static unsigned long nFreeFrames = 0;
 static int nRamFrames = 0;
 static int allocTableActive = 0;
-static int isTableActive()
+/*
+ * allocTableActive is only set by vm_bootstrap, before the secondary
+ * cpus start, so it can be read without taking freemem_lock.
+ */
+static int isTableActive(void)
 {
-	int active;
-	spinlock_acquire(&freemem_lock);
-	active = allocTableActive;
-	spinlock_release(&freemem_lock);
-	return active;
+	return allocTableActive;
+}
+
+/* Smallest order whose blocks can hold npages */
+static unsigned buddy_order(unsigned long npages)
+{
+	unsigned order = 0;
+	while (order <= BUDDY_MAX_ORDER && (1UL << order) < npages)
+		order++;
+	return order;
+}
+
+static void buddy_link(long frame, unsigned order)
+{
+	struct buddy_block *b = FRAME_TO_BLOCK(frame);
+
+	KASSERT(spinlock_do_i_hold(&freemem_lock));
+	KASSERT((frame & ((1L << order) - 1)) == 0);
+	b->prev = NULL;
+	b->next = freeLists[order];
+	if (b->next != NULL)
+		b->next->prev = b;
+	freeLists[order] = b;
+	frameInfo[frame] = BUDDY_FREE | order;
+	nFreeBlocks[order]++;
+	nFreeFrames += 1UL << order;
+}
+
+static void buddy_unlink(long frame, unsigned order)
+{
+	struct buddy_block *b = FRAME_TO_BLOCK(frame);
+
+	KASSERT(spinlock_do_i_hold(&freemem_lock));
+	KASSERT(frameInfo[frame] == (BUDDY_FREE | order));
+	if (b->prev != NULL)
+		b->prev->next = b->next;
+	else
+		freeLists[order] = b->next;
+	if (b->next != NULL)
+		b->next->prev = b->prev;
+	frameInfo[frame] = 0;
+	nFreeBlocks[order]--;
+	nFreeFrames -= 1UL << order;
+}
+
+/* Give back frames [start, end) as the largest aligned blocks that fit */
+static void buddy_add_range(long start, long end)
+{
+	unsigned order;
+
+	while (start < end)
+	{
+		order = 0;
+		while (order < BUDDY_MAX_ORDER &&
+			   (start & (1L << order)) == 0 &&
+			   start + (2L << order) <= end)
+			order++;
+		buddy_link(start, order);
+		start += 1L << order;
+	}
+}
+
+/* Free a single block, merging it with its buddy as long as possible */
+static void buddy_insert(long frame, unsigned order)
+{
+	long buddy;
+
+	KASSERT(spinlock_do_i_hold(&freemem_lock));
+	frameInfo[frame] = 0;
+	while (order < BUDDY_MAX_ORDER)
+	{
+		buddy = frame ^ (1L << order);
+		if (buddy + (1L << order) > nRamFrames ||
+			frameInfo[buddy] != (BUDDY_FREE | order))
+			break;
+		buddy_unlink(buddy, order);
+		frame &= ~(1L << order);
+		order++;
+	}
+	buddy_link(frame, order);
 }
 
 void vm_bootstrap(void)
 {
-	int i;
+	paddr_t firstFree;
 	nRamFrames = ((int)ram_getsize()) / PAGE_SIZE;
-	// int nKernelRamFrames = (int)MIPS_KSEG0 / PAGE_SIZE;
 
-	/* alloc freeRamFrame and allocSize */
-	freeRamFrames = kmalloc(sizeof(unsigned char) * nRamFrames);
-	allocSize = kmalloc(sizeof(unsigned long) * nRamFrames);
-	if (freeRamFrames == NULL || allocSize == NULL)
+	/* alloc frameInfo (still from ram_stealmem) */
+	frameInfo = kmalloc(sizeof(unsigned char) * nRamFrames);
+	if (frameInfo == NULL)
 	{
-		/* reset to disable this vm management */
-		freeRamFrames = NULL;
-		allocSize = NULL;
+		/* keep stealing memory: this vm management stays disabled */
 		return;
 	}
-	/* 	for (i = 0; i < nKernelRamFrames; i++)
-		{
-			freeRamFrames[i] = "k";
-			allocSize[i] = 0;
-		} */
-	for (i = 0; i < nRamFrames; i++)
-	{
-		freeRamFrames[i] = (unsigned char)0;
-		allocSize[i] = 0;
-	}
+	/* frames below firstFree (kernel image, stolen pages) are never freed */
+	bzero(frameInfo, sizeof(unsigned char) * nRamFrames);
+
+#if OPT_PAGING
+	coremap_bootstrap(nRamFrames);
+#endif
+
+	/* from now on ram_stealmem fails: the buddy allocator owns the rest */
+	firstFree = ram_getfirstfree();
+
+#if OPT_PAGING
+	coremap_setstate(ROUNDUP(firstFree, PAGE_SIZE),
+					 nRamFrames - ROUNDUP(firstFree, PAGE_SIZE) / PAGE_SIZE,
+					 CM_FREE);
+#endif
 	spinlock_acquire(&freemem_lock);
+	buddy_add_range((firstFree + PAGE_SIZE - 1) / PAGE_SIZE, nRamFrames);
 	allocTableActive = 1;
 	spinlock_release(&freemem_lock);
+#if OPT_SWAP
+	vm_lock = lock_create("vm");
+	vm_shootdown_sem = sem_create("tlbshootdown", 0);
+	if (vm_lock == NULL || vm_shootdown_sem == NULL)
+	{
+		panic("vm_bootstrap: out of memory\n");
+	}
+	swap_bootstrap();
+#endif
 #if MEMORY_PROFILING
 	if (isTableActive())
 	{
@@ -154,58 +321,264 @@ void vm_bootstrap(void)
 #endif
 }
 
-static int freeppages(paddr_t addr, unsigned long npages)
+/*
+ * Acquire freemem_lock, counting how often another cpu already held it.
+ * Protected by freemem_lock itself.
+ */
+static unsigned long freememAcquires = 0;
+static unsigned long freememContended = 0;
+
+static void freemem_lock_acquire(void)
 {
-	long i, first, np = (long)npages;
-	if (!isTableActive())
-		return 0;
-	first = addr / PAGE_SIZE;
-	KASSERT(allocSize != NULL);
-	KASSERT(nRamFrames > first);
+	bool busy = spinlock_data_get(&freemem_lock.splk_lock) != 0;
 	spinlock_acquire(&freemem_lock);
-	for (i = first; i < first + np; i++)
+	freememAcquires++;
+	if (busy)
+		freememContended++;
+}
+
+/* Free the allocation starting at frame (freemem_lock held) */
+static void buddy_free(long frame)
+{
+	unsigned order;
+	unsigned char info;
+
+	KASSERT(spinlock_do_i_hold(&freemem_lock));
+	do
+	{
+		info = frameInfo[frame];
+		KASSERT(info & BUDDY_USED);
+		order = info & BUDDY_ORDER_MASK;
+		buddy_insert(frame, order);
+		frame += 1L << order;
+	} while (info & BUDDY_CHAIN);
+}
+
+#if OPT_PAGING
+/*
+ * Number of frames in the allocation starting at frame. The caller
+ * owns the allocation, so its tags cannot change under us.
+ */
+static unsigned long buddy_npages(long frame)
+{
+	unsigned long npages = 0;
+	unsigned char info;
+
+	do
+	{
+		info = frameInfo[frame + npages];
+		KASSERT(info & BUDDY_USED);
+		npages += 1UL << (info & BUDDY_ORDER_MASK);
+	} while (info & BUDDY_CHAIN);
+	return npages;
+}
+#endif
+
+/* Allocate npages, returning the first frame or -1 (freemem_lock held) */
+static long buddy_alloc(unsigned long npages)
+{
+	unsigned order, k;
+	unsigned long remaining;
+	long frame, f;
+
+	KASSERT(spinlock_do_i_hold(&freemem_lock));
+	order = buddy_order(npages);
+	if (order > BUDDY_MAX_ORDER)
+		return -1;
+	/* Smallest free block that is large enough */
+	for (k = order; k <= BUDDY_MAX_ORDER && freeLists[k] == NULL; k++)
+		;
+	if (k > BUDDY_MAX_ORDER)
+		return -1;
+	frame = BLOCK_TO_FRAME(freeLists[k]);
+	buddy_unlink(frame, k);
+	/* Split it down to the requested order, freeing the upper halves */
+	while (k > order)
 	{
-		freeRamFrames[i] = (unsigned char)1;
+		k--;
+		buddy_link(frame + (1L << k), k);
 	}
-	spinlock_release(&freemem_lock);
-	return 1;
+	/* Keep exactly npages as a chain of decreasing blocks, free the tail */
+	remaining = npages;
+	f = frame;
+	for (k = order + 1; k-- > 0;)
+	{
+		if (remaining & (1UL << k))
+		{
+			remaining -= 1UL << k;
+			frameInfo[f] = BUDDY_USED | k | (remaining ? BUDDY_CHAIN : 0);
+			f += 1L << k;
+		}
+	}
+	buddy_add_range(f, frame + (1L << order));
+	return frame;
 }
 
-static paddr_t getfreeppages(unsigned long npages)
+/*
+ * Per-cpu cache of free single pages (curcpu->c_pagecache).
+ *
+ * Cached pages stay allocated as far as the buddy allocator is
+ * concerned. Only the owning cpu touches its cache, with interrupts
+ * off, so the common alloc_kpages(1)/free_kpages path takes no shared
+ * lock: freemem_lock is taken once per CPU_PAGECACHE_BATCH pages, to
+ * refill an empty cache or to drain a full one.
+ */
+static paddr_t pagecache_get(void)
 {
-	paddr_t addr;
-	long i, first, found, np = (long)npages;
-	if (!isTableActive())
+	struct cpu *c;
+	paddr_t addr = 0;
+	long frame;
+	int i, spl;
+
+	if (!CURCPU_EXISTS())
 		return 0;
-	spinlock_acquire(&freemem_lock);
-	// Linear search of free interval
-	for (i = 0, first = found = -1; i < nRamFrames; i++)
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_pagecache_count == 0)
 	{
-		if (freeRamFrames[i])
+		c->c_pagecache_misses++;
+		freemem_lock_acquire();
+		for (i = 0; i < CPU_PAGECACHE_BATCH; i++)
 		{
-			if (i == 0 || !freeRamFrames[i - 1])
-				first = i; /* set first free in an interval */
-			if (i - first + 1 >= np)
-			{
-				found = first;
+			frame = buddy_alloc(1);
+			if (frame < 0)
 				break;
-			}
+			c->c_pagecache[c->c_pagecache_count++] = (paddr_t)frame * PAGE_SIZE;
 		}
+		spinlock_release(&freemem_lock);
+		if (c->c_pagecache_count > 0)
+			c->c_pagecache_refills++;
+	}
+	else
+	{
+		c->c_pagecache_hits++;
+	}
+	if (c->c_pagecache_count > 0)
+	{
+		addr = c->c_pagecache[--c->c_pagecache_count];
 	}
-	if (found >= 0)
+	splx(spl);
+	return addr;
+}
+
+static int pagecache_put(paddr_t addr)
+{
+	struct cpu *c;
+	unsigned i;
+	int spl;
+
+	if (!CURCPU_EXISTS())
+		return 0;
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_pagecache_count == CPU_PAGECACHE_MAX)
 	{
-		for (i = found; i < found + np; i++)
+		/* give the oldest pages back, the newest ones are cache-hot */
+		freemem_lock_acquire();
+		for (i = 0; i < CPU_PAGECACHE_BATCH; i++)
+		{
+			buddy_free(c->c_pagecache[i] / PAGE_SIZE);
+		}
+		spinlock_release(&freemem_lock);
+		for (i = CPU_PAGECACHE_BATCH; i < CPU_PAGECACHE_MAX; i++)
 		{
-			freeRamFrames[i] = (unsigned char)0;
+			c->c_pagecache[i - CPU_PAGECACHE_BATCH] = c->c_pagecache[i];
 		}
-		allocSize[found] = np;
-		addr = (paddr_t)found * PAGE_SIZE;
+		c->c_pagecache_count -= CPU_PAGECACHE_BATCH;
+		c->c_pagecache_drains++;
 	}
-	else
+	c->c_pagecache[c->c_pagecache_count++] = addr;
+	splx(spl);
+	return 1;
+}
+
+/* Return the pages cached on this cpu to the buddy allocator */
+static void pagecache_flush(void)
+{
+	struct cpu *c;
+	int spl;
+
+	if (!CURCPU_EXISTS())
+		return;
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_pagecache_count > 0)
+	{
+		freemem_lock_acquire();
+		while (c->c_pagecache_count > 0)
+		{
+			buddy_free(c->c_pagecache[--c->c_pagecache_count] / PAGE_SIZE);
+		}
+		spinlock_release(&freemem_lock);
+		c->c_pagecache_drains++;
+	}
+	splx(spl);
+}
+
+static int freeppages(paddr_t addr)
+{
+	long frame;
+	unsigned char info;
+	if (!isTableActive())
+		return 0;
+	frame = addr / PAGE_SIZE;
+	KASSERT(frameInfo != NULL);
+	KASSERT(nRamFrames > frame);
+	/* the caller owns the frame, so its tag cannot change under us */
+	info = frameInfo[frame];
+	if ((info & BUDDY_USED) == 0)
+	{
+		/* stolen before vm_bootstrap: not managed by the buddy allocator */
+		return 0;
+	}
+#if OPT_PAGING
+	coremap_setstate(addr, buddy_npages(frame), CM_FREE);
+#endif
+	if (info == BUDDY_USED && pagecache_put(addr))
+	{
+		/* single page: keep it on this cpu */
+		return 1;
+	}
+	freemem_lock_acquire();
+	buddy_free(frame);
+	spinlock_release(&freemem_lock);
+	return 1;
+}
+
+static paddr_t getfreeppages(unsigned long npages)
+{
+	paddr_t addr;
+	long frame;
+	if (!isTableActive() || npages == 0)
+		return 0;
+	if (npages == 1)
 	{
-		addr = 0;
+		addr = pagecache_get();
+		if (addr != 0)
+		{
+#if OPT_PAGING
+			coremap_setstate(addr, 1, CM_KERNEL);
+#endif
+			return addr;
+		}
 	}
+	freemem_lock_acquire();
+	frame = buddy_alloc(npages);
 	spinlock_release(&freemem_lock);
+	if (frame < 0 && npages > 1)
+	{
+		/* pages cached here might be the buddies we are missing */
+		pagecache_flush();
+		freemem_lock_acquire();
+		frame = buddy_alloc(npages);
+		spinlock_release(&freemem_lock);
+	}
+	if (frame < 0)
+		return 0;
+	addr = (paddr_t)frame * PAGE_SIZE;
+#if OPT_PAGING
+	coremap_setstate(addr, npages, CM_KERNEL);
+#endif
 	return addr;
 }
 
@@ -222,161 +595,1174 @@ static paddr_t getppages(unsigned long npages)
 	/* try freed pages first */
 	addr = getfreeppages(npages);
 	if (addr == 0)
-	{ /* call stealmem */
+	{ /* call stealmem (only works before vm_bootstrap) */
 		spinlock_acquire(&stealmem_lock);
 		addr = ram_stealmem(npages);
 		spinlock_release(&stealmem_lock);
 	}
-	if (addr != 0 && isTableActive())
-	{
-		spinlock_acquire(&freemem_lock);
-		allocSize[addr / PAGE_SIZE] = npages;
-		spinlock_release(&freemem_lock);
+#if OPT_SWAP
+	if (addr == 0)
+	{ /* out of memory: make room by evicting user pages */
+		addr = vm_reclaim(npages);
 	}
+#endif
 #if MEMORY_PROFILING
 	if (isTableActive())
 	{
 		kprintf("After getppages:\n");
 		write_memstats();
 	}
-#endif
-	return addr;
+#endif
+	return addr;
+}
+
+void free_kpages(vaddr_t addr)
+{
+#if MEMORY_PROFILING
+	if (isTableActive())
+	{
+		kprintf("Before free_kpages:\n");
+		write_memstats();
+	}
+#endif
+	if (isTableActive())
+	{
+		paddr_t paddr = addr - MIPS_KSEG0;
+		freeppages(paddr);
+	}
+#if MEMORY_PROFILING
+	if (isTableActive())
+	{
+		kprintf("After free_kpages:\n");
+		write_memstats();
+	}
+#endif
+}
+
+#if !OPT_PAGING
+void as_destroy(struct addrspace *as)
+{
+#if MEMORY_PROFILING
+	if (isTableActive())
+	{
+		kprintf("Before as_destroy:\n");
+		write_memstats();
+	}
+#endif
+	dumbvm_can_sleep();
+	freeppages(as->as_pbase1);
+	freeppages(as->as_pbase2);
+	freeppages(as->as_stackpbase);
+	kfree(as);
+#if MEMORY_PROFILING
+	if (isTableActive())
+	{
+		kprintf("After as_destroy:\n");
+		write_memstats();
+	}
+#endif
+}
+#endif /* !OPT_PAGING */
+
+void write_memstats(void)
+{
+	unsigned long blocks[BUDDY_MAX_ORDER + 1];
+	unsigned long nfree, acquires, contended;
+	unsigned i;
+	struct cpu *c;
+
+	if (!isTableActive())
+	{
+		kprintf("Buddy allocator not active\n");
+		return;
+	}
+	/* take a snapshot, print it without holding the spinlock */
+	spinlock_acquire(&freemem_lock);
+	for (i = 0; i <= BUDDY_MAX_ORDER; i++)
+	{
+		blocks[i] = nFreeBlocks[i];
+	}
+	nfree = nFreeFrames;
+	acquires = freememAcquires;
+	contended = freememContended;
+	spinlock_release(&freemem_lock);
+
+	kprintf("Free frames: %lu/%d\n", nfree, nRamFrames);
+#if OPT_PAGING
+	coremap_printstats();
+#endif
+#if OPT_SWAP
+	swap_printstats();
+#endif
+	kprintf("freemem_lock: %lu acquires, %lu contended\n", acquires, contended);
+	kprintf("Cpu: cached pages, hits, misses, refills, drains\n");
+	for (i = 0; i < cpu_count(); i++)
+	{
+		c = cpu_get(i);
+		kprintf("%3u: %2u %8u %8u %8u %8u\n", c->c_number,
+				c->c_pagecache_count, c->c_pagecache_hits,
+				c->c_pagecache_misses, c->c_pagecache_refills,
+				c->c_pagecache_drains);
+	}
+	kprintf("Order (npages): free blocks\n");
+	for (i = 0; i <= BUDDY_MAX_ORDER; i++)
+	{
+		if (blocks[i] > 0)
+			kprintf("%2u (%6lu): %lu\n", i, 1UL << i, blocks[i]);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                    FINE                                    */
+/* -------------------------------------------------------------------------- */
+#elif OPT_BASIC_VM_DEALLOC == 0
+
+/* -------------------------------------------------------------------------- */
+/*                            Overwritten functions                           */
+/* -------------------------------------------------------------------------- */
+
+void vm_bootstrap(void)
+{
+	/* Do nothing. */
+}
+
+static paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr;
+
+	spinlock_acquire(&stealmem_lock);
+
+	addr = ram_stealmem(npages);
+
+	spinlock_release(&stealmem_lock);
+	return addr;
+}
+
+void free_kpages(vaddr_t addr)
+{
+	/* nothing - leak the memory. */
+
+	(void)addr;
+}
+
+void as_destroy(struct addrspace *as)
+{
+	dumbvm_can_sleep();
+	kfree(as);
+}
+#endif /* OPT_BASIC_VM_DEALLOC */
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa;
+
+	dumbvm_can_sleep();
+	pa = getppages(npages);
+	if (pa == 0)
+	{
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+/* Make this cpu's TLB entries tagged with ASID read-only (interrupts off) */
+static void vm_tlb_protect_asid(unsigned asid)
+{
+	uint32_t ehi, elo;
+	int i;
+
+	for (i = 0; i < NUM_TLB; i++)
+	{
+		tlb_read(&ehi, &elo, i);
+		if ((elo & TLBLO_VALID) && (elo & TLBLO_DIRTY) &&
+			(ehi & TLBHI_PID) >> TLBHI_PIDSHIFT == asid)
+		{
+			tlb_write(ehi, elo & ~TLBLO_DIRTY, i);
+		}
+	}
+	/* tlb_read changed the PID in entryhi */
+	tlb_setasid(curcpu->c_asid);
+}
+
+/*
+ * Flush this cpu's TLB, or write-protect one ASID, on behalf of
+ * another one (interrupts are off).
+ */
+void vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	int i;
+
+	if (ts->ts_asid != 0)
+	{
+		vm_tlb_protect_asid(ts->ts_asid);
+		V(ts->ts_done);
+		return;
+	}
+	for (i = 0; i < NUM_TLB; i++)
+	{
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	/* tlb_write changed the PID in entryhi */
+	tlb_setasid(curcpu->c_asid);
+	curcpu->c_tlb_flushes++;
+	V(ts->ts_done);
+}
+
+/*
+ * Load the translation FAULTADDRESS -> PADDR into the TLB, read-only
+ * unless WRITABLE. An entry already holding FAULTADDRESS (a read-only
+ * copy-on-write mapping) is overwritten, since two matching entries
+ * would be fatal. Otherwise an invalid entry is used if there is one,
+ * or the victim is picked by the hardware with tlb_random, so working
+ * sets larger than the TLB keep running instead of faulting forever.
+ */
+static int vm_tlb_insert(vaddr_t faultaddress, paddr_t paddr, bool writable)
+{
+	int i, spl;
+	uint32_t ehi, elo, asid;
+
+	/* make sure it's page-aligned */
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	/* entries are tagged with the ASID as_activate loaded on this cpu */
+	asid = curcpu->c_asid;
+
+	ehi = faultaddress | (asid << TLBHI_PIDSHIFT);
+	elo = paddr | (writable ? TLBLO_DIRTY : 0) | TLBLO_VALID;
+	i = tlb_probe(ehi, 0);
+	if (i >= 0)
+	{
+		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x (updating)\n", faultaddress, paddr);
+		tlb_write(ehi, elo, i);
+		tlb_setasid(asid);
+		curcpu->c_tlb_faults++;
+		curcpu->c_tlb_faults_update++;
+		splx(spl);
+		return 0;
+	}
+
+	for (i = 0; i < NUM_TLB; i++)
+	{
+		uint32_t oldehi, oldelo;
+
+		tlb_read(&oldehi, &oldelo, i);
+		if (oldelo & TLBLO_VALID)
+		{
+			continue;
+		}
+		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+		tlb_write(ehi, elo, i);
+		tlb_setasid(asid);
+		curcpu->c_tlb_faults++;
+		curcpu->c_tlb_faults_free++;
+		splx(spl);
+		return 0;
+	}
+
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x (replacing)\n", faultaddress, paddr);
+	tlb_random(ehi, elo);
+	tlb_setasid(asid);
+	curcpu->c_tlb_faults++;
+	curcpu->c_tlb_faults_replace++;
+	splx(spl);
+	return 0;
+}
+
+/*
+ * TLB statistics: per-cpu counters, updated with interrupts off and
+ * summed up here without locking, so the totals are a snapshot.
+ */
+void vm_tlbstats(void)
+{
+	unsigned long faults = 0, faults_free = 0, faults_replace = 0;
+	unsigned long faults_update = 0, invalidations = 0;
+	struct cpu *c;
+	unsigned i;
+
+	for (i = 0; i < cpu_count(); i++)
+	{
+		c = cpu_get(i);
+		faults += c->c_tlb_faults;
+		faults_free += c->c_tlb_faults_free;
+		faults_replace += c->c_tlb_faults_replace;
+		faults_update += c->c_tlb_faults_update;
+		invalidations += c->c_tlb_invalidations;
+	}
+
+	kprintf("TLB faults: %lu\n", faults);
+	kprintf("TLB faults with free entry: %lu\n", faults_free);
+	kprintf("TLB faults with replacement: %lu\n", faults_replace);
+	kprintf("TLB faults updating an entry: %lu\n", faults_update);
+	kprintf("TLB invalidations: %lu\n", invalidations);
+	kprintf("Cpu: ASID, faults, flushes, flushes avoided\n");
+	for (i = 0; i < cpu_count(); i++)
+	{
+		c = cpu_get(i);
+		kprintf("%3u: %2u %8u %8u %8u\n", c->c_number, c->c_asid,
+				c->c_tlb_faults, c->c_tlb_flushes,
+				c->c_tlb_flushes_avoided);
+	}
+}
+
+#if OPT_PAGING
+/* -------------------------------------------------------------------------- */
+/*                   Two-level page tables and demand paging                  */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Pages are not allocated by as_prepare_load any more: the first
+ * access to a page of a region (or of the stack) faults, and vm_fault
+ * allocates a zero-filled frame and records it in the page table.
+ * The frames of an address space need not be contiguous, and a
+ * program only pays for the pages it actually touches.
+ *
+ * Copy-on-write: as_copy does not copy any page. pt_copy makes parent
+ * and child map the same frames, marked PTE_COW in both page tables
+ * and counted once per mapping in the coremap. COW pages are loaded
+ * into the TLB read-only, so the first store to one of them traps
+ * (VM_FAULT_READONLY, or VM_FAULT_WRITE if it was not in the TLB)
+ * and vm_cow_break gives the writer a private copy, or simply takes
+ * the frame back if nobody else maps it any more. A fork followed by
+ * exec copies nothing at all.
+ */
+
+static struct spinlock cowstats_lock = SPINLOCK_INITIALIZER;
+static struct vm_cowstats cowstats;
+
+void vm_getcowstats(struct vm_cowstats *stats)
+{
+	spinlock_acquire(&cowstats_lock);
+	*stats = cowstats;
+	spinlock_release(&cowstats_lock);
+}
+
+/*
+ * Take vm_lock unless this thread already holds it (e.g. a fault that
+ * needs a page and evicts one). Returns true if it was taken here and
+ * must be released with vm_lock_release. No-ops without options swap.
+ */
+static bool vm_lock_acquire(void)
+{
+#if OPT_SWAP
+	if (vm_lock != NULL && !lock_do_i_hold(vm_lock))
+	{
+		lock_acquire(vm_lock);
+		return true;
+	}
+#endif
+	return false;
+}
+
+static void vm_lock_release(bool acquired)
+{
+#if OPT_SWAP
+	if (acquired)
+	{
+		lock_release(vm_lock);
+	}
+#else
+	(void)acquired;
+#endif
+}
+
+#if OPT_SWAP
+/*
+ * Page eviction.
+ *
+ * When the frame allocator runs dry, getppages calls vm_reclaim, which
+ * asks the coremap clock for a victim (a user page owned by a single
+ * address space and not used lately), writes it to swap and takes its
+ * frame. The PTE of the page keeps the swap slot, and the next access
+ * to the page faults it back in.
+ *
+ * The owner of the victim may be running on another cpu, with the
+ * page in its TLB. The PTE is invalidated first, then every TLB is
+ * flushed (there is no way to tell which cpus hold the translation,
+ * nor under which ASID), and only then is the page written out: a
+ * later access can only fault and wait for vm_lock.
+ */
+static void vm_tlbflush_all(void)
+{
+	struct tlbshootdown ts;
+	struct cpu *c;
+	unsigned i, n = 0;
+	int spl;
+
+	ts.ts_done = vm_shootdown_sem;
+	ts.ts_asid = 0;
+
+	/* don't migrate between flushing here and choosing the others */
+	spl = splhigh();
+	for (i = 0; i < NUM_TLB; i++)
+	{
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	tlb_setasid(curcpu->c_asid);
+	curcpu->c_tlb_flushes++;
+	curcpu->c_tlb_invalidations++;
+	for (i = 0; i < cpu_count(); i++)
+	{
+		c = cpu_get(i);
+		if (c != curcpu->c_self)
+		{
+			ipi_tlbshootdown(c, &ts);
+			n++;
+		}
+	}
+	splx(spl);
+
+	while (n-- > 0)
+	{
+		P(vm_shootdown_sem);
+	}
+}
+
+/* The address space mapping the user frame PADDR at VADDR, if any */
+static struct addrspace *vm_find_mapping(paddr_t paddr, vaddr_t vaddr)
+{
+	struct addrspace *as;
+	pte_t *pte;
+
+	for (as = vm_aslist; as != NULL; as = as->as_next)
+	{
+		pte = pt_get(as->as_pt, vaddr, false);
+		if (pte != NULL && (*pte & PTE_VALID) &&
+			(*pte & PTE_FRAME) == paddr)
+		{
+			return as;
+		}
+	}
+	return NULL;
+}
+
+/* Evict one user page, returning its frame (CM_KERNEL) or 0 */
+static paddr_t vm_evict(void)
+{
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t paddr;
+	pte_t *pte;
+	unsigned slot, refcount;
+	int result;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+	if (!coremap_victim(&paddr, &as, &vaddr))
+	{
+		return 0;
+	}
+	if (as == NULL)
+	{
+		/*
+		 * Shared by fork (or by processes running the same program)
+		 * and the others are gone: find who is left and make it
+		 * the owner.
+		 */
+		as = vm_find_mapping(paddr, vaddr);
+		if (as == NULL || !coremap_adopt(paddr, as))
+		{
+			/* mapped elsewhere (file page), or shared again */
+			coremap_unpin(paddr);
+			return 0;
+		}
+	}
+	pte = pt_get(as->as_pt, vaddr, false);
+	KASSERT(pte != NULL);
+	KASSERT((*pte & PTE_VALID) && (*pte & PTE_FRAME) == paddr);
+
+	refcount = (*pte & PTE_COW) ? coremap_file_unhash(paddr) : 0;
+	if (refcount != 0)
+	{
+		/*
+		 * A clean page of the executable, in the file page index.
+		 * Just drop it, vm_fault reads it again.
+		 *
+		 * vm_fault looks file pages up without vm_lock, so another
+		 * process may have taken a reference since the clock chose
+		 * this frame. It is unhashed first, so that no more can be
+		 * taken, then checked; and checked again after the
+		 * shootdown before freeing.
+		 */
+		if (refcount != 1)
+		{
+			/* shared after all: keep it, it's just unindexed */
+			coremap_unpin(paddr);
+			return 0;
+		}
+		*pte = 0;
+		vm_tlbflush_all();
+		DEBUG(DB_VM, "dumbvm: dropped file page 0x%x (0x%x)\n",
+			  vaddr, paddr);
+		coremap_unpin(paddr);
+		if (coremap_decref(paddr) != 0)
+		{
+			return 0;
+		}
+		return paddr;
+	}
+
+	/*
+	 * Anything else goes to swap, copy-on-write pages too: the others
+	 * sharing the frame are gone, and a page swapped back in is
+	 * private anyway.
+	 */
+	*pte &= ~PTE_VALID;
+	vm_tlbflush_all();
+
+	result = swap_out(paddr, &slot);
+	if (result)
+	{
+		/* swap is full: leave it where it is */
+		*pte |= PTE_VALID;
+		coremap_unpin(paddr);
+		return 0;
+	}
+	DEBUG(DB_VM, "dumbvm: evicted 0x%x (0x%x) to slot %u\n",
+		  vaddr, paddr, slot);
+	*pte = PTE_MKSWAPPED(slot);
+	coremap_unpin(paddr);
+	result = coremap_decref(paddr);
+	KASSERT(result == 0);
+	return paddr;
+}
+
+/*
+ * Get NPAGES frames by evicting user pages. A single page is handed
+ * over directly; for more, NPAGES evicted frames are freed in the hope
+ * that they coalesce with free neighbours, and the allocation retried.
+ */
+static paddr_t vm_reclaim(unsigned long npages)
+{
+	paddr_t paddr = 0;
+	unsigned long i;
+	bool acquired;
+
+	if (vm_lock == NULL || !swap_enabled())
+	{
+		return 0;
+	}
+	acquired = vm_lock_acquire();
+	if (npages == 1)
+	{
+		paddr = vm_evict();
+	}
+	else
+	{
+		for (i = 0; i < npages; i++)
+		{
+			paddr = vm_evict();
+			if (paddr == 0)
+				break;
+			freeppages(paddr);
+		}
+		paddr = getfreeppages(npages);
+	}
+	vm_lock_release(acquired);
+	return paddr;
+}
+#endif /* OPT_SWAP */
+
+/* The region of AS containing VADDR, or NULL */
+static struct as_region *as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_region *ar;
+	unsigned i;
+
+	for (i = 0; i < as->as_nregions; i++)
+	{
+		ar = &as->as_regions[i];
+		if (vaddr >= ar->ar_vbase &&
+			vaddr < ar->ar_vbase + ar->ar_npages * PAGE_SIZE)
+			return ar;
+	}
+	return NULL;
+}
+
+/* True if VADDR belongs to a region or to the stack of AS */
+static bool as_valid_addr(struct addrspace *as, vaddr_t vaddr)
+{
+	if (as_find_region(as, vaddr) != NULL)
+		return true;
+	return vaddr >= USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE &&
+		   vaddr < USERSTACK;
+}
+
+#if OPT_LAZY_ELF
+/*
+ * Fill the frame at KVA with page VADDR of the file-backed region AR:
+ * the bytes of the page that come from the executable are read from
+ * it, the rest (the BSS tail, the bytes before an unaligned segment)
+ * is zero-filled.
+ */
+static int as_load_page(struct as_region *ar, vaddr_t vaddr, vaddr_t kva)
+{
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	bzero((void *)kva, PAGE_SIZE);
+	start = vaddr > ar->ar_filevbase ? vaddr : ar->ar_filevbase;
+	end = vaddr + PAGE_SIZE;
+	if (end > ar->ar_filevbase + ar->ar_filesize)
+		end = ar->ar_filevbase + ar->ar_filesize;
+	if (start >= end)
+	{
+		/* all BSS */
+		return 0;
+	}
+
+	DEBUG(DB_EXEC, "ELF: loading %lu bytes to 0x%lx\n",
+		  (unsigned long)(end - start), (unsigned long)start);
+	uio_kinit(&iov, &ku, (void *)(kva + (start - vaddr)), end - start,
+			  ar->ar_offset + (start - ar->ar_filevbase), UIO_READ);
+	result = VOP_READ(ar->ar_vnode, &ku);
+	if (result)
+	{
+		return result;
+	}
+	if (ku.uio_resid != 0)
+	{
+		kprintf("ELF: short read on page 0x%lx - file truncated?\n",
+				(unsigned long)vaddr);
+		return ENOEXEC;
+	}
+	return 0;
+}
+
+/*
+ * If page VADDR of region AR is a read-only page of the executable,
+ * fill in KEY, under which it is shared among address spaces, and
+ * return true.
+ */
+static bool as_page_key(struct as_region *ar, vaddr_t vaddr,
+						struct coremap_filekey *key)
+{
+	if (ar->ar_vnode == NULL || (ar->ar_perm & AS_WRITE))
+	{
+		return false;
+	}
+	/* same page of the file at the same page offset */
+	if ((ar->ar_filevbase & ~PAGE_FRAME) != (ar->ar_offset & ~PAGE_FRAME))
+	{
+		return false;
+	}
+	key->fk_vnode = ar->ar_vnode;
+	key->fk_offset = ar->ar_offset + ((off_t)vaddr - ar->ar_filevbase);
+	key->fk_start = ar->ar_offset;
+	key->fk_end = ar->ar_offset + ar->ar_filesize;
+	return true;
+}
+#endif
+
+/* Give AS write access to the COW page at VADDR, mapped by *PTE */
+static int vm_cow_break(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+	vaddr_t kva;
+	int spl;
+
+	oldpa = *pte & PTE_FRAME;
+	if (coremap_refcount(oldpa) == 1)
+	{
+		/* the others sharing it are gone: no copy needed */
+		*pte &= ~PTE_COW;
+		coremap_setowner(oldpa, as);
+		spinlock_acquire(&cowstats_lock);
+		cowstats.cs_reused++;
+		spinlock_release(&cowstats_lock);
+		return 0;
+	}
+
+	kva = alloc_kpages(1);
+	if (kva == 0)
+	{
+		return ENOMEM;
+	}
+	memmove((void *)kva, (const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	newpa = KVADDR_TO_PADDR(kva);
+	coremap_setuser(newpa, as, vaddr);
+	*pte = newpa | (*pte & ~(PTE_FRAME | PTE_COW));
+	if (coremap_decref(oldpa) == 0)
+	{
+		/* the last sharer wrote its own copy meanwhile */
+		free_kpages(PADDR_TO_KVADDR(oldpa));
+	}
+	/*
+	 * Other cpus that ran us under our ASID may still hold entries
+	 * for the old frame: if there are any, get a new one at the next
+	 * as_activate. This cpu's entry is overwritten by vm_tlb_insert.
+	 */
+	spl = splhigh();
+	if (as->as_cpus & ~((uint32_t)1 << curcpu->c_number))
+	{
+		as->as_asid_generation = 0;
+	}
+	splx(spl);
+
+	spinlock_acquire(&cowstats_lock);
+	cowstats.cs_copied++;
+	spinlock_release(&cowstats_lock);
+	return 0;
+}
+
+/*
+ * Make the TLB entries of AS, whose pages have all just become
+ * copy-on-write, read-only: here, and on the other cpus that ran it
+ * under its current ASID. The entries stay valid, so the parent of a
+ * fork keeps its ASID and what it has in the TLB.
+ */
+static void vm_tlb_protect(struct addrspace *as)
+{
+	struct tlbshootdown ts;
+	struct semaphore *sem = NULL;
+	uint32_t others;
+	unsigned i, n = 0;
+	int spl;
+
+	for (;;)
+	{
+		/* interrupts off: we must not move to one of the others */
+		spl = splhigh();
+		others = as->as_cpus & ~((uint32_t)1 << curcpu->c_number);
+		if (others == 0 || sem != NULL)
+		{
+			break;
+		}
+		splx(spl);
+		sem = sem_create("tlbprotect", 0);
+		if (sem == NULL)
+		{
+			/* can't wait for them: take a new ASID instead */
+			as->as_asid_generation = 0;
+			if (as == proc_getas())
+			{
+				as_activate();
+			}
+			return;
+		}
+	}
+
+	vm_tlb_protect_asid(as->as_asid);
+	ts.ts_done = sem;
+	ts.ts_asid = as->as_asid;
+	for (i = 0; i < cpu_count(); i++)
+	{
+		if (others & ((uint32_t)1 << i))
+		{
+			ipi_tlbshootdown(cpu_get(i), &ts);
+			n++;
+		}
+	}
+	splx(spl);
+
+	while (n-- > 0)
+	{
+		P(sem);
+	}
+	if (sem != NULL)
+	{
+		sem_destroy(sem);
+	}
+}
+
+/* Drop the reference to SHARED taken by coremap_file_lookup */
+static void vm_file_release(paddr_t shared)
+{
+	if (coremap_decref(shared) == 0)
+	{
+		free_kpages(PADDR_TO_KVADDR(shared));
+	}
+}
+
+/*
+ * Load the translation for FAULTADDRESS of AS (vm_lock held). If the
+ * page is not resident, it can come from SHARED (if not 0), a frame
+ * of the file page index we hold a reference to, or from LOADED (if
+ * not 0), a frame already holding its initial contents, to be indexed
+ * under KEY if not NULL. vm_page_in takes care of releasing both.
+ */
+static int vm_page_in(struct addrspace *as, int faulttype, vaddr_t faultaddress,
+					  vaddr_t loaded, paddr_t shared,
+					  const struct coremap_filekey *key)
+{
+	pte_t *pte;
+	vaddr_t kva;
+	paddr_t pa;
+	int result;
+
+	pte = pt_get(as->as_pt, faultaddress, true);
+	if (pte == NULL)
+	{
+		if (loaded != 0)
+			free_kpages(loaded);
+		if (shared != 0)
+			vm_file_release(shared);
+		return ENOMEM;
+	}
+	if ((*pte & PTE_VALID) == 0 && shared != 0)
+	{
+		/* someone else's copy of the same page */
+		KASSERT(*pte == 0);
+		*pte = shared | PTE_VALID | PTE_COW;
+		shared = 0;
+	}
+	else if ((*pte & PTE_VALID) == 0 && loaded != 0)
+	{
+		/* never touched before: no swap slot to read instead */
+		KASSERT(*pte == 0);
+		pa = KVADDR_TO_PADDR(loaded);
+		if (key != NULL)
+		{
+			/* share it read-only from now on */
+			pa = coremap_file_insert(pa, key, as, faultaddress);
+			if (pa == KVADDR_TO_PADDR(loaded))
+				loaded = 0;
+			*pte = pa | PTE_VALID | PTE_COW;
+		}
+		else
+		{
+			coremap_setuser(pa, as, faultaddress);
+			loaded = 0;
+			*pte = pa | PTE_VALID;
+		}
+	}
+	if (loaded != 0)
+	{
+		free_kpages(loaded);
+	}
+	if (shared != 0)
+	{
+		vm_file_release(shared);
+	}
+	if ((*pte & PTE_VALID) == 0)
+	{
+		kva = alloc_kpages(1);
+		if (kva == 0)
+		{
+			return ENOMEM;
+		}
+#if OPT_SWAP
+		if (*pte & PTE_SWAPPED)
+		{
+			/* Evicted: read it back */
+			result = swap_in(PTE_SLOT(*pte), KVADDR_TO_PADDR(kva));
+			if (result)
+			{
+				free_kpages(kva);
+				return result;
+			}
+			swap_free(PTE_SLOT(*pte));
+		}
+		else
+#endif
+		{
+			/* First touch: give the page a zero-filled frame */
+			bzero((void *)kva, PAGE_SIZE);
+		}
+		*pte = KVADDR_TO_PADDR(kva) | PTE_VALID;
+		coremap_setuser(KVADDR_TO_PADDR(kva), as, faultaddress);
+	}
+	else
+	{
+		coremap_touch(*pte & PTE_FRAME);
+	}
+	if ((*pte & PTE_COW) && faulttype != VM_FAULT_READ)
+	{
+		result = vm_cow_break(as, faultaddress, pte);
+		if (result)
+		{
+			return result;
+		}
+	}
+
+	return vm_tlb_insert(faultaddress, *pte & PTE_FRAME,
+						 (*pte & PTE_COW) == 0);
+}
+
+int vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	vaddr_t loaded = 0;
+	paddr_t shared = 0;
+	const struct coremap_filekey *key = NULL;
+	bool acquired;
+	int result;
+#if OPT_LAZY_ELF
+	struct coremap_filekey pagekey;
+	struct as_region *ar;
+	pte_t *pte;
+#endif
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype)
+	{
+	case VM_FAULT_READONLY:
+		/* Only COW pages are mapped read-only, see below */
+	case VM_FAULT_READ:
+	case VM_FAULT_WRITE:
+		break;
+	default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL)
+	{
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = proc_getas();
+	if (as == NULL)
+	{
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	KASSERT(as->as_pt != NULL);
+
+	if (!as_valid_addr(as, faultaddress))
+	{
+		return EFAULT;
+	}
+
+#if OPT_LAZY_ELF
+	ar = as_find_region(as, faultaddress);
+	if (ar != NULL && ar->ar_vnode != NULL)
+	{
+		/*
+		 * Only this process' thread makes pages of its own go from
+		 * never touched to resident, so the check is safe without
+		 * vm_lock, which must not be held across the file I/O
+		 * (the file system may fault on user pages or need memory).
+		 */
+		pte = pt_get(as->as_pt, faultaddress, false);
+		if ((pte == NULL || *pte == 0) &&
+			as_page_key(ar, faultaddress, &pagekey))
+		{
+			/* another process running the same program may have it */
+			key = &pagekey;
+			shared = coremap_file_lookup(key);
+		}
+		if ((pte == NULL || *pte == 0) && shared == 0)
+		{
+			loaded = alloc_kpages(1);
+			if (loaded == 0)
+			{
+				return ENOMEM;
+			}
+			result = as_load_page(ar, faultaddress, loaded);
+			if (result)
+			{
+				free_kpages(loaded);
+				return result;
+			}
+		}
+	}
+#endif
+
+	acquired = vm_lock_acquire();
+	result = vm_page_in(as, faulttype, faultaddress, loaded, shared, key);
+	vm_lock_release(acquired);
+	return result;
+}
+
+/*
+ * Wiring. A file system may hold a lock of its own across uiomove
+ * (emufs does), and a fault on a user page that has to be read from
+ * the executable would then need it again. So system calls doing I/O
+ * straight to user memory fault the pages in beforehand, outside the
+ * file system, and keep them resident until the I/O is over.
+ */
+
+/* Make page VADDR of AS resident (and private, for WRITE) and wire it */
+static int vm_wire_page(struct addrspace *as, vaddr_t vaddr, bool write)
+{
+	pte_t *pte;
+	bool acquired, wired;
+	int result;
+
+	for (;;)
+	{
+		acquired = vm_lock_acquire();
+		pte = pt_get(as->as_pt, vaddr, false);
+		wired = pte != NULL && (*pte & PTE_VALID) &&
+				!(write && (*pte & PTE_COW));
+		if (wired)
+		{
+			coremap_wire(*pte & PTE_FRAME);
+		}
+		vm_lock_release(acquired);
+		if (wired)
+		{
+			return 0;
+		}
+		/* not there yet, or evicted again before we got vm_lock */
+		result = vm_fault(write ? VM_FAULT_WRITE : VM_FAULT_READ, vaddr);
+		if (result)
+		{
+			return result;
+		}
+	}
 }
 
-void free_kpages(vaddr_t addr)
+/* Unwire the pages of AS in [START, END), all wired */
+static void vm_unwire_pages(struct addrspace *as, vaddr_t start, vaddr_t end)
 {
-#if MEMORY_PROFILING
-	if (isTableActive())
+	pte_t *pte;
+	vaddr_t vaddr;
+	bool acquired;
+
+	acquired = vm_lock_acquire();
+	for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE)
 	{
-		kprintf("Before free_kpages:\n");
-		write_memstats();
+		pte = pt_get(as->as_pt, vaddr, false);
+		KASSERT(pte != NULL && (*pte & PTE_VALID));
+		coremap_unwire(*pte & PTE_FRAME);
 	}
-#endif
-	if (isTableActive())
+	vm_lock_release(acquired);
+}
+
+int vm_wire(userptr_t base, size_t len, bool write)
+{
+	struct addrspace *as;
+	vaddr_t start, end, vaddr;
+	int result;
+
+	if (len == 0)
 	{
-		paddr_t paddr = addr - MIPS_KSEG0;
-		long first = paddr / PAGE_SIZE;
-		KASSERT(allocSize != NULL);
-		KASSERT(nRamFrames > first);
-		freeppages(paddr, allocSize[first]);
+		return 0;
 	}
-#if MEMORY_PROFILING
-	if (isTableActive())
+	start = (vaddr_t)base & PAGE_FRAME;
+	end = (vaddr_t)base + len;
+	if (end < (vaddr_t)base || end > USERSPACETOP)
 	{
-		kprintf("After free_kpages:\n");
-		write_memstats();
+		return EFAULT;
 	}
-#endif
-}
-
-void as_destroy(struct addrspace *as)
-{
-#if MEMORY_PROFILING
-	if (isTableActive())
+	as = proc_getas();
+	if (as == NULL)
 	{
-		kprintf("Before as_destroy:\n");
-		write_memstats();
+		return EFAULT;
 	}
-#endif
-	dumbvm_can_sleep();
-	freeppages(as->as_pbase1, as->as_npages1);
-	freeppages(as->as_pbase2, as->as_npages2);
-	freeppages(as->as_stackpbase, DUMBVM_STACKPAGES);
-	kfree(as);
-#if MEMORY_PROFILING
-	if (isTableActive())
+	for (vaddr = start; vaddr < end; vaddr += PAGE_SIZE)
 	{
-		kprintf("After as_destroy:\n");
-		write_memstats();
+		result = vm_wire_page(as, vaddr, write);
+		if (result)
+		{
+			vm_unwire_pages(as, start, vaddr);
+			return result;
+		}
 	}
-#endif
+	return 0;
 }
 
-void write_memstats(void)
+void vm_unwire(userptr_t base, size_t len)
 {
-#if MEMORY_PROFILING
-	int i;
-	kprintf("RamFrames (0=allocated, 1=free)): AllocSize (nframes)\n");
-	for (i = 0; i < nRamFrames; i++)
+	struct addrspace *as;
+
+	if (len == 0)
 	{
-		kprintf("%u:%lu\t", freeRamFrames[i], allocSize[i]);
-		if (i % 16 == 15)
-			kprintf("\n");
+		return;
 	}
-	kprintf("\n");
-#endif
-}
-
-/* -------------------------------------------------------------------------- */
-/*                                    FINE                                    */
-/* -------------------------------------------------------------------------- */
-#elif OPT_BASIC_VM_DEALLOC == 0
-
-/* -------------------------------------------------------------------------- */
-/*                            Overwritten functions                           */
-/* -------------------------------------------------------------------------- */
-
-void vm_bootstrap(void)
-{
-	/* Do nothing. */
+	as = proc_getas();
+	KASSERT(as != NULL);
+	vm_unwire_pages(as, (vaddr_t)base & PAGE_FRAME, (vaddr_t)base + len);
 }
 
-static paddr_t
-getppages(unsigned long npages)
+struct addrspace *
+as_create(void)
 {
-	paddr_t addr;
-
-	spinlock_acquire(&stealmem_lock);
+	struct addrspace *as;
+#if OPT_SWAP
+	bool acquired;
+#endif
 
-	addr = ram_stealmem(npages);
+	as = kmalloc(sizeof(struct addrspace));
+	if (as == NULL)
+	{
+		return NULL;
+	}
 
-	spinlock_release(&stealmem_lock);
-	return addr;
-}
+	as->as_asid = 0;
+	as->as_asid_generation = 0;
+	as->as_cpus = 0;
+	as->as_nregions = 0;
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL)
+	{
+		kfree(as);
+		return NULL;
+	}
 
-void free_kpages(vaddr_t addr)
-{
-	/* nothing - leak the memory. */
+#if OPT_SWAP
+	acquired = vm_lock_acquire();
+	as->as_next = vm_aslist;
+	if (as->as_next != NULL)
+	{
+		as->as_next->as_pprev = &as->as_next;
+	}
+	as->as_pprev = &vm_aslist;
+	vm_aslist = as;
+	vm_lock_release(acquired);
+#endif
 
-	(void)addr;
+	return as;
 }
 
 void as_destroy(struct addrspace *as)
 {
-	dumbvm_can_sleep();
-	kfree(as);
-}
-#endif /* OPT_BASIC_VM_DEALLOC */
-
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t
-alloc_kpages(unsigned npages)
-{
-	paddr_t pa;
+	bool acquired;
+#if OPT_LAZY_ELF
+	unsigned i;
+#endif
 
 	dumbvm_can_sleep();
-	pa = getppages(npages);
-	if (pa == 0)
+	DEBUG(DB_VM, "dumbvm: destroying address space with %u resident pages\n",
+		  pt_resident(as->as_pt));
+	acquired = vm_lock_acquire();
+#if OPT_SWAP
+	*as->as_pprev = as->as_next;
+	if (as->as_next != NULL)
 	{
-		return 0;
+		as->as_next->as_pprev = as->as_pprev;
 	}
-	return PADDR_TO_KVADDR(pa);
+#endif
+	pt_destroy(as->as_pt);
+	vm_lock_release(acquired);
+#if OPT_LAZY_ELF
+	for (i = 0; i < as->as_nregions; i++)
+	{
+		if (as->as_regions[i].ar_vnode != NULL)
+		{
+			VOP_DECREF(as->as_regions[i].ar_vnode);
+		}
+	}
+#endif
+	kfree(as);
 }
 
-void vm_tlbshootdown(const struct tlbshootdown *ts)
-{
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
+#else /* OPT_PAGING */
 
 int vm_fault(int faulttype, vaddr_t faultaddress)
 {
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
 	struct addrspace *as;
-	int spl;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -452,30 +1838,22 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-	/* make sure it's page-aligned */
-	KASSERT((paddr & PAGE_FRAME) == paddr);
-
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
+	return vm_tlb_insert(faultaddress, paddr, true);
+}
 
-	for (i = 0; i < NUM_TLB; i++)
-	{
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID)
-		{
-			continue;
-		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
-	}
+/* All pages are resident from as_prepare_load on: nothing to do */
+int vm_wire(userptr_t base, size_t len, bool write)
+{
+	(void)base;
+	(void)len;
+	(void)write;
+	return 0;
+}
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
-	splx(spl);
-	return EFAULT;
+void vm_unwire(userptr_t base, size_t len)
+{
+	(void)base;
+	(void)len;
 }
 
 struct addrspace *
@@ -487,6 +1865,9 @@ as_create(void)
 		return NULL;
 	}
 
+	as->as_asid = 0;
+	as->as_asid_generation = 0;
+	as->as_cpus = 0;
 	as->as_vbase1 = 0;
 	as->as_pbase1 = 0;
 	as->as_npages1 = 0;
@@ -497,25 +1878,85 @@ as_create(void)
 
 	return as;
 }
+#endif /* OPT_PAGING */
+
+/*
+ * ASID allocation.
+ *
+ * Each address space gets an ASID the first time it is activated, and
+ * its TLB entries are tagged with it, so entries of several address
+ * spaces coexist in the TLB and switching between them needs no flush.
+ * ASIDs are handed out in increasing order; when they run out a new
+ * generation starts and every address space gets a new ASID the next
+ * time it runs. A cpu flushes its TLB only when it first activates an
+ * ASID of a generation newer than the entries it holds. An ASID is
+ * never reused within a generation, so stale entries of destroyed
+ * address spaces can never match. as_cpus records the cpus that ran
+ * an address space since it got its ASID, the only ones that can hold
+ * entries of it.
+ *
+ * ASID 0 is never handed out.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static unsigned asid_generation = 1;
+static unsigned asid_next = 1;
 
 void as_activate(void)
 {
 	int i, spl;
+	unsigned generation;
 	struct addrspace *as;
+	struct cpu *c;
 
 	as = proc_getas();
 	if (as == NULL)
 	{
+		/*
+		 * Kernel-only thread: leave the TLB alone, the user
+		 * entries it holds will be useful when we switch back.
+		 */
 		return;
 	}
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
+	c = curcpu->c_self;
 
-	for (i = 0; i < NUM_TLB; i++)
+	spinlock_acquire(&asid_lock);
+	if (as->as_asid_generation != asid_generation)
 	{
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		if (asid_next == NUM_ASID)
+		{
+			asid_generation++;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next++;
+		as->as_asid_generation = asid_generation;
+		as->as_cpus = 0;
+	}
+	/* lamebus has at most 32 cpus */
+	KASSERT(c->c_number < 32);
+	as->as_cpus |= (uint32_t)1 << c->c_number;
+	generation = asid_generation;
+	spinlock_release(&asid_lock);
+
+	if (c->c_asid_generation != generation)
+	{
+		/* ASIDs were recycled: entries from older ones could match */
+		for (i = 0; i < NUM_TLB; i++)
+		{
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		c->c_asid_generation = generation;
+		c->c_tlb_flushes++;
+		c->c_tlb_invalidations++;
 	}
+	else
+	{
+		c->c_tlb_flushes_avoided++;
+	}
+	c->c_asid = as->as_asid;
+	tlb_setasid(as->as_asid);
 
 	splx(spl);
 }
@@ -525,6 +1966,156 @@ void as_deactivate(void)
 	/* nothing */
 }
 
+#if OPT_PAGING
+int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+					 int readable, int writeable, int executable)
+{
+	struct as_region *ar;
+
+	dumbvm_can_sleep();
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	/* nothing copies in through uiomove to catch kernel addresses */
+	if (vaddr + sz < vaddr || vaddr + sz > MIPS_KSEG0)
+	{
+		return EFAULT;
+	}
+
+	if (as->as_nregions == AS_MAXREGIONS)
+	{
+		kprintf("dumbvm: Warning: too many regions\n");
+		return ENOSYS;
+	}
+
+	ar = &as->as_regions[as->as_nregions++];
+	ar->ar_vbase = vaddr;
+	ar->ar_npages = sz / PAGE_SIZE;
+	ar->ar_perm = (readable ? AS_READ : 0) | (writeable ? AS_WRITE : 0) |
+				  (executable ? AS_EXEC : 0);
+#if OPT_LAZY_ELF
+	ar->ar_vnode = NULL;
+#endif
+	return 0;
+}
+
+#if OPT_LAZY_ELF
+int as_define_file(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+				   off_t offset, size_t filesize)
+{
+	struct as_region *ar;
+
+	ar = as_find_region(as, vaddr);
+	if (ar == NULL || vaddr + filesize < vaddr ||
+		vaddr + filesize > ar->ar_vbase + ar->ar_npages * PAGE_SIZE)
+	{
+		return EFAULT;
+	}
+	KASSERT(ar->ar_vnode == NULL);
+
+	/* the region keeps the executable open until it goes away */
+	VOP_INCREF(v);
+	ar->ar_vnode = v;
+	ar->ar_filevbase = vaddr;
+	ar->ar_offset = offset;
+	ar->ar_filesize = filesize;
+	return 0;
+}
+#endif
+
+int as_prepare_load(struct addrspace *as)
+{
+	dumbvm_can_sleep();
+	/* Nothing to allocate: vm_fault fills pages in as they are touched */
+	(void)as;
+	return 0;
+}
+
+int as_complete_load(struct addrspace *as)
+{
+	dumbvm_can_sleep();
+	(void)as;
+	return 0;
+}
+
+int as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	KASSERT(as->as_pt != NULL);
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+int as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+	struct pagetable *pt;
+	unsigned nshared;
+	bool acquired;
+	int result;
+#if OPT_LAZY_ELF
+	unsigned i;
+#endif
+
+	dumbvm_can_sleep();
+
+	new = as_create();
+	if (new == NULL)
+	{
+		return ENOMEM;
+	}
+
+	memcpy(new->as_regions, old->as_regions, sizeof(old->as_regions));
+	new->as_nregions = old->as_nregions;
+#if OPT_LAZY_ELF
+	for (i = 0; i < new->as_nregions; i++)
+	{
+		if (new->as_regions[i].ar_vnode != NULL)
+		{
+			VOP_INCREF(new->as_regions[i].ar_vnode);
+		}
+	}
+#endif
+
+	/* Pages are shared copy-on-write, nothing is copied yet */
+	nshared = 0;
+	acquired = vm_lock_acquire();
+	result = pt_copy(old->as_pt, &pt, &nshared);
+	if (result == 0)
+	{
+		/* vm_evict may be walking the new one already */
+		pt_destroy(new->as_pt);
+		new->as_pt = pt;
+	}
+	vm_lock_release(acquired);
+	if (result)
+	{
+		as_destroy(new);
+		return result;
+	}
+
+	/*
+	 * The parent's pages are read-only now, but TLBs may still hold
+	 * writable entries for them under its ASID.
+	 */
+	vm_tlb_protect(old);
+
+	spinlock_acquire(&cowstats_lock);
+	cowstats.cs_forks++;
+	cowstats.cs_shared += nshared;
+	spinlock_release(&cowstats_lock);
+
+	*ret = new;
+	return 0;
+}
+
+#else /* OPT_PAGING */
+
 int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 					 int readable, int writeable, int executable)
 {
@@ -664,3 +2255,5 @@ int as_copy(struct addrspace *old, struct addrspace **ret)
 	*ret = new;
 	return 0;
 }
+
+#endif /* OPT_PAGING */
@@ -76,6 +76,51 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Read c0_count, the cycles since c0_compare was last written.
+ */
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+/* Cycles per hardclock */
+#define MIPS_TIMER_PERIOD (CPU_FREQUENCY / HZ)
+
+/*
+ * Tickless idle. The on-chip timer counts 32 bits of cycles, which at
+ * 25 MHz is a little under three minutes.
+ */
+void
+mainbus_timer_oneshot(unsigned hardclocks)
+{
+	if (hardclocks > 0xffffffffU / MIPS_TIMER_PERIOD) {
+		hardclocks = 0xffffffffU / MIPS_TIMER_PERIOD;
+	}
+	mips_timer_set(hardclocks * MIPS_TIMER_PERIOD);
+}
+
+unsigned
+mainbus_timer_periodic(void)
+{
+	uint32_t count;
+
+	count = mips_timer_get();
+	mips_timer_set(MIPS_TIMER_PERIOD);
+	return count / MIPS_TIMER_PERIOD;
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -116,7 +161,7 @@ mainbus_bootstrap(void)
 	/*
 	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	mips_timer_set(MIPS_TIMER_PERIOD);
 }
 
 /*
@@ -315,7 +360,7 @@ mainbus_interrupt(struct trapframe *tf)
 	}
 	if (cause & MIPS_TIMER_BIT) {
 		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
+		mips_timer_set(MIPS_TIMER_PERIOD);
 		/* and call hardclock */
 		hardclock();
 		seen = true;
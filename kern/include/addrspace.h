@@ -37,8 +37,44 @@
 
 #include <vm.h>
 #include "opt-dumbvm.h"
+#include "opt-paging.h"
+#include "opt-lazy_elf.h"
+#include "opt-swap.h"
 
 struct vnode;
+struct pagetable;
+
+#if OPT_PAGING
+/* Max number of regions defined by as_define_region (stack excluded) */
+#define AS_MAXREGIONS 4
+
+/* Region permissions */
+#define AS_READ  0x4
+#define AS_WRITE 0x2
+#define AS_EXEC  0x1
+
+/*
+ * A range of user pages with the same permissions. Its pages are
+ * allocated on demand by vm_fault.
+ *
+ * With options lazy_elf a region can be backed by an executable: the
+ * ar_filesize bytes at ar_offset in ar_vnode are the initial contents
+ * of the memory from ar_filevbase (not page aligned), the rest of the
+ * region starts out zero-filled. vm_fault reads each page from the
+ * file the first time it is touched.
+ */
+struct as_region {
+        vaddr_t ar_vbase;
+        size_t ar_npages;
+        int ar_perm;
+#if OPT_LAZY_ELF
+        struct vnode *ar_vnode;         /* NULL if not file-backed */
+        vaddr_t ar_filevbase;
+        off_t ar_offset;
+        size_t ar_filesize;
+#endif
+};
+#endif
 
 
 /*
@@ -50,6 +86,18 @@ struct vnode;
 
 struct addrspace {
 #if OPT_DUMBVM
+        unsigned as_asid;               /* TLB address space ID */
+        unsigned as_asid_generation;    /* ASID generation of as_asid */
+        uint32_t as_cpus;               /* cpus that ran it with as_asid */
+#if OPT_PAGING
+        struct as_region as_regions[AS_MAXREGIONS];
+        unsigned as_nregions;
+        struct pagetable *as_pt;        /* two-level page table */
+#if OPT_SWAP
+        struct addrspace *as_next;      /* all address spaces (vm_lock) */
+        struct addrspace **as_pprev;
+#endif
+#else
         vaddr_t as_vbase1;
         paddr_t as_pbase1;
         size_t as_npages1;
@@ -57,6 +105,7 @@ struct addrspace {
         paddr_t as_pbase2;
         size_t as_npages2;
         paddr_t as_stackpbase;
+#endif
 #else
         /* Put stuff here for your VM system */
 #endif
@@ -99,6 +148,10 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_define_file - (options lazy_elf) take the initial contents of
+ *                the region containing VADDR from FILESIZE bytes at
+ *                OFFSET in executable V, instead of loading them now.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -117,6 +170,11 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if OPT_LAZY_ELF
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 struct vnode *v, off_t offset,
+                                 size_t filesize);
+#endif
 
 
 /*
@@ -48,6 +48,17 @@
 void hardclock_bootstrap(void);
 void hardclock(void);
 
+/*
+ * Tickless idle: hardclock_idle() is called by a cpu about to idle,
+ * with interrupts off, to stop its periodic hardclocks, and
+ * hardclock_unidle() when it wakes up, to start them again. While
+ * hardclock_tickless is false, idle cpus keep ticking, and so do cpus
+ * with timeouts pending.
+ */
+extern bool hardclock_tickless;
+void hardclock_idle(void);
+void hardclock_unidle(void);
+
 /*
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -79,5 +90,12 @@ void timespec_sub(const struct timespec *t1,
  */
 void clocksleep(int seconds);
 
+/*
+ * thread_sleep_ticks() suspends execution for TICKS hardclocks: the
+ * thread runs again at the TICKS-th hardclock from now, so the first
+ * one may be a partial period.
+ */
+void thread_sleep_ticks(unsigned ticks);
+
 
 #endif /* _CLOCK_H_ */
@@ -0,0 +1,144 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Coremap: one entry per physical frame, indexed by frame number
+ * (paddr / PAGE_SIZE), telling what the frame is used for.
+ *
+ * State:
+ *   CM_FREE    in the buddy allocator or in a per-cpu page cache.
+ *   CM_FIXED   kernel image and memory stolen before vm_bootstrap,
+ *              never freed.
+ *   CM_KERNEL  allocated with alloc_kpages by the kernel.
+ *   CM_USER    holds a user page.
+ *
+ * For user frames the entry also records the virtual address of the
+ * page, the address space owning it and a reference count: the number
+ * of page-table entries mapping the frame. A frame shared copy-on-write
+ * by several address spaces has one reference for each of them and no
+ * single owner (NULL); it goes back to the allocator when the last
+ * reference is dropped. When all but one are dropped the frame stays
+ * without an owner until the eviction code looks for the address
+ * space still mapping it and hands it over (coremap_adopt).
+ *
+ * A pinned frame must stay where it is (e.g. while I/O is in progress
+ * on it): it is never chosen for reclamation. Neither is a wired one,
+ * which a system call is reading or writing through its user mapping;
+ * unlike the pin, several calls can wire the same frame at once.
+ *
+ * Reclamation (options swap) follows the second-chance clock: a hand
+ * sweeps the coremap, clearing the reference bit of the user frames
+ * it passes, and picks the first one whose bit was already clear.
+ * The bit is set whenever vm_fault loads a translation for the frame.
+ *
+ * File page index: frames holding a page of a read-only segment of an
+ * executable are also indexed by what they contain (the file and the
+ * page within it), so that every address space running the program
+ * maps the same frame, copy-on-write, instead of reading its own copy.
+ * A frame leaves the index when its last reference is dropped or when
+ * it becomes private to an address space that writes to it.
+ */
+
+#include <types.h>
+
+struct addrspace;
+struct vnode;
+
+/*
+ * Contents of a page read from a file: the page that starts at file
+ * offset fk_offset of fk_vnode, with only the bytes that fall within
+ * [fk_start, fk_end) taken from the file and the rest zero-filled.
+ */
+struct coremap_filekey
+{
+	struct vnode *fk_vnode;
+	off_t fk_offset;
+	off_t fk_start;
+	off_t fk_end;
+};
+
+#define CM_FREE 0
+#define CM_FIXED 1
+#define CM_KERNEL 2
+#define CM_USER 3
+
+/*
+ * Allocate the coremap for NFRAMES frames, all CM_FIXED: vm_bootstrap
+ * then makes the frames it hands to the buddy allocator CM_FREE.
+ */
+void coremap_bootstrap(unsigned long nframes);
+
+/* Set the state of NPAGES frames from PADDR (frame allocator) */
+void coremap_setstate(paddr_t paddr, unsigned long npages, unsigned state);
+
+/* Make the frame at PADDR a user page of AS at VADDR, with one reference */
+void coremap_setuser(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+
+/*
+ * Make AS the owner of the user frame at PADDR, now mapped only by it
+ * and about to be written: it leaves the file page index.
+ */
+void coremap_setowner(paddr_t paddr, struct addrspace *as);
+
+/*
+ * Make AS, which maps it, the owner of the user frame at PADDR, left
+ * without one after being shared. Returns false if it is shared again.
+ */
+bool coremap_adopt(paddr_t paddr, struct addrspace *as);
+
+/* Add a reference to the user frame at PADDR */
+void coremap_incref(paddr_t paddr);
+
+/* Drop a reference to the user frame at PADDR, return how many are left */
+unsigned coremap_decref(paddr_t paddr);
+
+/* Current number of references to the frame at PADDR */
+unsigned coremap_refcount(paddr_t paddr);
+
+/* Pin/unpin the frame at PADDR */
+void coremap_pin(paddr_t paddr);
+void coremap_unpin(paddr_t paddr);
+bool coremap_pinned(paddr_t paddr);
+
+/* Wire/unwire the user frame at PADDR (nested) */
+void coremap_wire(paddr_t paddr);
+void coremap_unwire(paddr_t paddr);
+
+/* Set the reference bit of the user frame at PADDR */
+void coremap_touch(paddr_t paddr);
+
+/*
+ * Advance the clock to a user frame that can be evicted: mapped by a
+ * single address space, neither pinned nor wired and not recently
+ * referenced. The frame is returned pinned, with its owner (NULL if
+ * it is not known, see above) and virtual address.
+ * Returns false if there is no such frame.
+ */
+bool coremap_victim(paddr_t *paddr, struct addrspace **as, vaddr_t *vaddr);
+
+/*
+ * Look KEY up in the file page index. If a frame holds that page, add
+ * a reference to it and return its paddr, otherwise return 0.
+ */
+paddr_t coremap_file_lookup(const struct coremap_filekey *key);
+
+/*
+ * Make the frame at PADDR, just filled with the page KEY, a user page
+ * of AS at VADDR and publish it in the file page index. If another
+ * frame with the same page got there first, a reference to that one
+ * is returned instead, and the caller frees its own.
+ */
+paddr_t coremap_file_insert(paddr_t paddr, const struct coremap_filekey *key,
+							struct addrspace *as, vaddr_t vaddr);
+
+/*
+ * Take the frame at PADDR out of the file page index, so that no new
+ * reference to it can be found there, and return its reference count;
+ * return 0 if it was not in the index.
+ */
+unsigned coremap_file_unhash(paddr_t paddr);
+
+/* Print the number of frames in each state */
+void coremap_printstats(void);
+
+#endif /* _COREMAP_H_ */
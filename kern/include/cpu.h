@@ -33,7 +33,23 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <timeout.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include "opt-basic_vm_dealloc.h"
+#include "opt-dumbvm.h"
+
+/* Per-cpu cache of free pages (see dumbvm.c) */
+#define CPU_PAGECACHE_MAX	16	/* pages cached at most */
+#define CPU_PAGECACHE_BATCH	8	/* pages moved per refill/drain */
+
+/* Levels of the per-cpu multilevel feedback run queue (see thread.c) */
+#define CPU_RUNQUEUE_LEVELS	4
+
+/* Per-cpu kmalloc magazines (see kmalloc.c) */
+#define CPU_KMAG_CLASSES	16	/* size classes with magazines */
+#define CPU_KMALLOC_ROWS	17	/* size classes, plus whole pages */
+
+struct kmagazine;
 
 
 /*
@@ -61,15 +77,85 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_sched_lastboost;	/* c_hardclocks at the last boost */
+	unsigned c_sched_demotions;	/* Quanta used up (thread demoted) */
+	unsigned c_sched_preemptions;	/* Yields to a higher level thread */
+	unsigned c_sched_boosts;	/* Priority boosts */
+	unsigned c_sched_steals;	/* Threads stolen when about to idle */
+	unsigned c_sched_migrations;	/* Threads pushed to other cpus */
+	unsigned c_tickless_ticks;	/* Idle timer deadline, 0 if periodic
+					   (others read it as a hint) */
+	unsigned c_idle_wakeups;	/* Returns from cpu_idle() */
+	unsigned c_idle_hardclocks;	/* hardclock() calls while idle */
+
+#if OPT_BASIC_VM_DEALLOC
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Free single pages kept in front of the frame allocator,
+	 * plus counters for the page cache hit rate.
+	 */
+	paddr_t c_pagecache[CPU_PAGECACHE_MAX];
+	unsigned c_pagecache_count;	/* Pages in c_pagecache */
+	unsigned c_pagecache_hits;	/* Allocations served by the cache */
+	unsigned c_pagecache_misses;	/* Allocations that found it empty */
+	unsigned c_pagecache_refills;	/* Batches taken from the allocator */
+	unsigned c_pagecache_drains;	/* Batches given back to it */
+#endif
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * kmalloc magazines of each small size class (the loaded one and
+	 * the previous one), plus counters for their hit rate.
+	 */
+	struct kmagazine *c_kmag_loaded[CPU_KMAG_CLASSES];
+	struct kmagazine *c_kmag_previous[CPU_KMAG_CLASSES];
+	unsigned c_kmag_allochits;	/* kmallocs served by a magazine */
+	unsigned c_kmag_allocmisses;	/* kmallocs that went to the pages */
+	unsigned c_kmag_freehits;	/* kfrees kept in a magazine */
+	unsigned c_kmag_freemisses;	/* kfrees that went to the pages */
+
+	/*
+	 * Also with interrupts off: kmallocs of each size class (and of
+	 * whole pages, in the last row), with the bytes they asked for
+	 * and the bytes they got, for the fragmentation report of kh.
+	 */
+	unsigned c_kmalloc_nreq[CPU_KMALLOC_ROWS];
+	uint64_t c_kmalloc_reqbytes[CPU_KMALLOC_ROWS];
+	uint64_t c_kmalloc_allocbytes[CPU_KMALLOC_ROWS];
+
+#if OPT_DUMBVM
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * ASID loaded in the MMU and generation of the ASIDs whose
+	 * entries may be in this cpu's TLB (see as_activate), and TLB
+	 * counters, summed up by vm_tlbstats.
+	 */
+	unsigned c_asid;
+	unsigned c_asid_generation;
+	unsigned c_tlb_flushes;		/* as_activate calls that flushed */
+	unsigned c_tlb_flushes_avoided;	/* as_activate calls that did not */
+	unsigned c_tlb_faults;		/* translations loaded by vm_fault */
+	unsigned c_tlb_faults_free;	/* ...into an invalid entry */
+	unsigned c_tlb_faults_replace;	/* ...evicting a valid entry */
+	unsigned c_tlb_faults_update;	/* ...overwriting a stale one */
+	unsigned c_tlb_invalidations;	/* whole-TLB flushes started here */
+#endif
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[CPU_RUNQUEUE_LEVELS]; /* By priority */
+	unsigned c_runqueue_count;	/* Threads on all levels */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus (to cancel timeouts).
+	 * Protected by its own lock. Advanced by this cpu's hardclock.
+	 */
+	struct timerwheel c_timerwheel;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -112,6 +198,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Number of cpus, and the cpu with software number N, for code that
+ * needs to look at all of them (e.g. to print statistics).
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned n);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -0,0 +1,97 @@
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches (slab allocator).
+ *
+ * A cache hands out objects of a single type. Small objects are
+ * carved out of whole pages (slabs) at their exact size and alignment,
+ * instead of being rounded up to a kmalloc size class; large ones
+ * (thread stacks) are allocated one at a time with kmalloc.
+ *
+ * The optional constructor is run when an object is first created,
+ * not each time it is allocated: objects must be given back to the
+ * cache in their constructed state (e.g. with their wait channel
+ * still there and nobody sleeping on it), and the next kmem_cache_alloc
+ * gets them that way. The destructor is run when the memory of the
+ * object goes back to the system. A constructor can fail, returning
+ * an error code, in which case kmem_cache_alloc returns NULL.
+ *
+ * Each cache counts the objects and memory it uses, printed by
+ * kmem_cache_printstats.
+ *
+ * Caches used from boot on are defined statically with
+ * KMEM_CACHE_INITIALIZER; others are made with kmem_cache_create.
+ */
+
+#include <types.h>
+#include <spinlock.h>
+
+struct kmem_slab; /* Opaque */
+
+/* Free large objects kept constructed, at most */
+#define KMEM_LARGE_MAX 8
+
+struct kmem_cache
+{
+	/* Fixed at creation */
+	const char *kc_name;
+	size_t kc_size;
+	size_t kc_align;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	/* Protected by kc_lock */
+	struct spinlock kc_lock;
+	bool kc_ready;				/* layout computed, on the list */
+	size_t kc_stride;			/* bytes per object in a slab */
+	unsigned kc_perslab;		/* objects per slab, 0 if large */
+	struct kmem_slab *kc_partial;
+	struct kmem_slab *kc_full;
+	struct kmem_slab *kc_empty;
+	unsigned kc_nempty;
+	void *kc_large[KMEM_LARGE_MAX]; /* free large objects */
+	unsigned kc_nlarge;
+	struct kmem_cache *kc_next; /* all caches */
+
+	/* Accounting */
+	unsigned kc_inuse;
+	unsigned kc_peak;
+	unsigned kc_total;			/* objects allocated, in use or not */
+	unsigned kc_nslabs;
+	unsigned kc_allocs;
+	unsigned kc_ctors;
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, align, ctor, dtor) \
+	{                                                          \
+		.kc_name = (name),                                     \
+		.kc_size = (size),                                     \
+		.kc_align = (align),                                   \
+		.kc_ctor = (ctor),                                     \
+		.kc_dtor = (dtor),                                     \
+		.kc_lock = SPINLOCK_INITIALIZER,                       \
+	}
+
+/*
+ * Create a cache of objects of SIZE bytes aligned to ALIGN (0 for the
+ * default). CTOR and DTOR may be NULL. NAME should be a string
+ * constant.
+ */
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+									 size_t align, int (*ctor)(void *),
+									 void (*dtor)(void *));
+
+/* Destroy a cache made by kmem_cache_create. No object may be in use. */
+void kmem_cache_destroy(struct kmem_cache *kc);
+
+/* Allocate an object, constructed. Returns NULL if out of memory. */
+void *kmem_cache_alloc(struct kmem_cache *kc);
+
+/* Give back an object of KC, in its constructed state */
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+/* Print the memory used by each cache */
+void kmem_cache_printstats(void);
+
+#endif /* _KMEM_CACHE_H_ */
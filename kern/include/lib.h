@@ -125,6 +125,13 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_profile_start and stop turn on and off the allocation
+ * profiler, which counts live blocks and bytes by call site of
+ * kmalloc; kheap_profile_print prints what it has gathered.
+ *
+ * kheap_nlive counts the small blocks in use, as printed by
+ * kheap_printstats.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
@@ -132,6 +139,10 @@ void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_profile_start(void);
+void kheap_profile_stop(void);
+void kheap_profile_print(void);
+unsigned kheap_nlive(void);
 
 /*
  * C string functions.
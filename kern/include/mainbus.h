@@ -55,6 +55,17 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Control of the per-cpu hardclock timer, for tickless idle.
+ * mainbus_timer_oneshot makes the timer of the current cpu go off
+ * once, HARDCLOCKS hardclock periods from now (or as far as it can
+ * count, if less); mainbus_timer_periodic puts it back to ticking HZ
+ * times a second and returns the number of whole periods that went
+ * by in between.
+ */
+void mainbus_timer_oneshot(unsigned hardclocks);
+unsigned mainbus_timer_periodic(void);
+
 /* Request breaking into the debugger, where available. */
 void mainbus_debugger(void);
 
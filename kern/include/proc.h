@@ -88,6 +88,7 @@ struct proc
 
 #if OPT_FILE_SYSTEM
 	struct openfile *p_fileTable[OPEN_MAX];
+	uint32_t p_fdMap[OPEN_MAX / 32]; /* fds in use, under p_lock */
 #endif
 };
 
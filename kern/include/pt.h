@@ -0,0 +1,67 @@
+#ifndef _PT_H_
+#define _PT_H_
+
+/*
+ * Two-level page table for user address spaces.
+ *
+ * A user virtual address is split 10/10/12: the top 10 bits index the
+ * first-level directory, the next 10 bits index a second-level table
+ * of PTEs, the low 12 bits are the offset in the page. Second-level
+ * tables are allocated only for the parts of the address space that
+ * are actually used, so a sparse address space (text at the bottom,
+ * stack at the top) costs a handful of pages.
+ *
+ * A PTE holds the physical frame of the page plus some flag bits in
+ * the low, page-offset bits. The PTE of a page evicted to swap (not
+ * PTE_VALID but PTE_SWAPPED) holds its swap slot in place of the frame.
+ */
+
+#include <vm.h>
+
+#define PT_ENTRIES 1024
+#define PT_L1_INDEX(va) (((va) >> 22) & (PT_ENTRIES - 1))
+#define PT_L2_INDEX(va) (((va) >> 12) & (PT_ENTRIES - 1))
+
+typedef uint32_t pte_t;
+
+#define PTE_VALID 0x001	 /* page is resident in PTE_FRAME */
+#define PTE_COW 0x002	 /* frame shared copy-on-write, map it read-only */
+#define PTE_SWAPPED 0x004 /* page is in swap slot PTE_SLOT */
+#define PTE_FRAME PAGE_FRAME
+
+#define PTE_SLOT(pte) ((unsigned)((pte) >> 12))
+#define PTE_MKSWAPPED(slot) (((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+struct pagetable
+{
+	pte_t *pt_l2[PT_ENTRIES]; /* second-level tables, NULL if unused */
+};
+
+/* Create an empty page table */
+struct pagetable *pt_create(void);
+
+/*
+ * Free the page table, dropping its reference to every resident page
+ * and releasing the swap slots of the swapped ones.
+ */
+void pt_destroy(struct pagetable *pt);
+
+/*
+ * Get the PTE for VADDR. If its second-level table does not exist,
+ * allocate it when CREATE is true, otherwise return NULL. Also
+ * returns NULL if the allocation fails.
+ */
+pte_t *pt_get(struct pagetable *pt, vaddr_t vaddr, bool create);
+
+/*
+ * Duplicate a page table. Resident pages are not copied: both tables
+ * map the same frames, marked PTE_COW in both. The number of pages
+ * shared is added to *NSHARED. Swapped pages get a swap slot of their
+ * own in the copy.
+ */
+int pt_copy(struct pagetable *old, struct pagetable **ret, unsigned *nshared);
+
+/* Number of resident pages */
+unsigned pt_resident(struct pagetable *pt);
+
+#endif /* _PT_H_ */
@@ -0,0 +1,38 @@
+#ifndef _SWAPFILE_H_
+#define _SWAPFILE_H_
+
+/*
+ * Swap space for evicted user pages.
+ *
+ * The swap area is a whole raw disk (SWAP_DEVICE), attached with
+ * vfs_swapon and divided into page-sized slots; a bitmap tells which
+ * slots are in use. A swapped-out page is found from its PTE, which
+ * holds the slot number (see pt.h).
+ */
+
+#include <types.h>
+
+#define SWAP_DEVICE "lhd0"
+
+/* Attach SWAP_DEVICE; if that fails the system runs without swap */
+void swap_bootstrap(void);
+
+/* True if swap space is available */
+bool swap_enabled(void);
+
+/* Write the page in frame PADDR to a free slot, returned in *SLOT */
+int swap_out(paddr_t paddr, unsigned *slot);
+
+/* Read SLOT into frame PADDR (the slot stays allocated) */
+int swap_in(unsigned slot, paddr_t paddr);
+
+/* Release SLOT */
+void swap_free(unsigned slot);
+
+/* Copy SLOT to a new slot, returned in *NEWSLOT */
+int swap_dup(unsigned slot, unsigned *newslot);
+
+/* Print slot usage and I/O counters */
+void swap_printstats(void);
+
+#endif /* _SWAPFILE_H_ */
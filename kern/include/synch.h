@@ -53,6 +53,12 @@ struct semaphore
 struct semaphore *sem_create(const char *name, unsigned initial_count);
 void sem_destroy(struct semaphore *);
 
+/*
+ * Set the count of a semaphore nobody is waiting on, so that it can be
+ * used again as if just created (e.g. when its owner is cached).
+ */
+void sem_reset(struct semaphore *, unsigned count);
+
 /*
  * Operations (both atomic):
  *     P (proberen): decrement count. If the count is 0, block until
@@ -62,6 +68,12 @@ void sem_destroy(struct semaphore *);
 void P(struct semaphore *);
 void V(struct semaphore *);
 
+/*
+ * Like P, but give up after TICKS hardclocks. Returns true if the
+ * count was decremented, false if the time ran out.
+ */
+bool P_timeout(struct semaphore *, unsigned ticks);
+
 #include "opt-locks_semaphores.h"
 #include "opt-locks_wchans.h"
 /*
@@ -110,6 +122,20 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+#if OPT_LOCKS_SEMAPHORES || OPT_LOCKS_WCHANS
+/*
+ * If true (the default), lock_acquire spins for a while before
+ * sleeping when the lock's owner is running on another cpu.
+ */
+extern bool lock_adaptive;
+#endif
+
+/*
+ * Like lock_acquire, but give up after TICKS hardclocks. Returns true
+ * if the lock was acquired.
+ */
+bool lock_acquire_timeout(struct lock *, unsigned ticks);
+
 /*
  * Condition variable.
  *
@@ -159,4 +185,12 @@ void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+/*
+ * Like cv_wait, but wake up by itself after TICKS hardclocks. Returns
+ * false if the time ran out (even if signalled at the same time), true
+ * otherwise; either way the lock is held again on return, and, as
+ * with cv_wait, the caller should check its condition.
+ */
+bool cv_wait_timeout(struct cv *cv, struct lock *lock, unsigned ticks);
+
 #endif /* _SYNCH_H_ */
@@ -56,6 +56,7 @@ __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t user_req, userptr_t user_rem);
 
 /*
  My Syscalls
@@ -70,8 +71,8 @@ int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
  * with other pointers.
  */
 
-long sys_write(int fd, userptr_t buf, size_t nbytes);
-long sys_read(int fd, userptr_t buf, size_t count);
+int sys_write(int fd, userptr_t buf, size_t nbytes, int32_t *retval);
+int sys_read(int fd, userptr_t buf, size_t count, int32_t *retval);
 
 void sys__exit(int status);
 
@@ -84,8 +85,25 @@ int sys_fork(struct trapframe *ctf, pid_t *retval);
 #if OPT_FILE_SYSTEM
 int sys_open(userptr_t pathname, int flags, mode_t mode, int *errp);
 int sys_close(int fd);
-
-// void openfileIncrRefCount(struct openfile *of);
+int sys_readv(int fd, userptr_t iov, int iovcnt, int32_t *retval);
+int sys_writev(int fd, userptr_t iov, int iovcnt, int32_t *retval);
+int sys_preadv(int fd, userptr_t iov, int iovcnt, off_t offset,
+			   int32_t *retval);
+int sys_pwritev(int fd, userptr_t iov, int iovcnt, off_t offset,
+				int32_t *retval);
+int sys_pread(int fd, userptr_t buf, size_t count, off_t offset,
+			  int32_t *retval);
+int sys_pwrite(int fd, userptr_t buf, size_t count, off_t offset,
+			   int32_t *retval);
+
+struct openfile;
+struct proc;
+void openfileIncrRefCount(struct openfile *of);
+void openfileDecrRefCount(struct openfile *of);
+void proc_file_table_close(struct proc *p);
+void proc_file_table_copy(struct proc *psrc, struct proc *pdest);
+int sys_dup2(int oldfd, int newfd, int32_t *retval);
+int sys_lseek(int fd, off_t pos, int whence, off_t *retval);
 
 #endif
 
@@ -50,10 +50,14 @@ int threadlisttest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int wakeuplatencybench(int, char **);
+int idlewakeupbench(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
+int lockbench(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int timedwaittest(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
@@ -93,7 +97,13 @@ int kmalloctest(int, char **);
 int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
+int kmalloctest5(int, char **);
+int kmallocbench(int, char **);
 int nettest(int, char **);
+int forkbench(int, char **);
+int swaptest(int, char **);
+int filewritebench(int, char **);
+int openclosebench(int, char **);
 
 /* Routine for running a user-level program. */
 int runprogram(char *progname);
@@ -72,6 +72,7 @@ struct thread
 	 */
 	char *t_name;			  /* Name of this thread */
 	const char *t_wchan_name; /* Name of wait channel, if sleeping */
+	struct wchan *t_wchan;	  /* Wait channel it's on, if sleeping */
 	threadstate_t t_state;	  /* State this thread is in */
 
 	/*
@@ -82,6 +83,8 @@ struct thread
 	void *t_stack;					  /* Kernel-level stack */
 	struct switchframe *t_context;	  /* Saved register context (on stack) */
 	struct cpu *t_cpu;				  /* CPU thread runs on */
+	unsigned t_priority;			  /* Run queue level, 0 is highest */
+	unsigned t_ticks;				  /* Hardclocks used at this level */
 	struct proc *t_proc;			  /* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);		  /* Deadlock detector hook */
 
@@ -166,10 +169,19 @@ void thread_yield(void);
  */
 void schedule(void);
 
+/*
+ * Charge the current thread for a hardclock; it yields if its quantum
+ * is used up (and is demoted) or a higher priority thread is waiting.
+ */
+void thread_tick(void);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
  */
 void thread_consider_migration(void);
 
+/* Print the scheduler counters of each cpu. */
+void thread_printstats(void);
+
 #endif /* _THREAD_H_ */
@@ -0,0 +1,74 @@
+#ifndef _TIMEOUT_H_
+#define _TIMEOUT_H_
+
+/*
+ * Timeouts: call a function after a number of hardclocks.
+ *
+ * Each cpu has a hierarchical timer wheel, advanced by its hardclock.
+ * Level 0 has one slot per tick for the next TW_SLOTS ticks; each
+ * level above has slots TW_SLOTS times as wide, and a slot is
+ * redistributed to the level below when the wheel gets to it. Adding
+ * and cancelling a timeout is O(1), and a tick costs a slot of level
+ * 0, plus a slot of level 1 every TW_SLOTS ticks, and so on.
+ *
+ * A timeout is added to the wheel of the current cpu and runs there,
+ * from hardclock, with interrupts off and no locks held: it may take
+ * spinlocks and wake threads up, but not sleep. It can be cancelled
+ * from any cpu. Timeouts longer than TIMEOUT_MAXTICKS are cut to it.
+ *
+ * A struct timeout belongs to the caller (it can be on the stack) and
+ * must not be freed while it is pending or its function is running;
+ * timeout_cancel waits for the latter.
+ */
+
+#include <spinlock.h>
+
+#define TW_LEVELS 4
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TIMEOUT_MAXTICKS ((1U << (TW_LEVELS * TW_BITS)) - 1)
+
+struct timerwheel;
+
+struct timeout
+{
+	struct timeout *to_next;
+	struct timeout **to_pprev;		/* &previous->to_next, or slot */
+	unsigned to_expires;			/* tw_now when it goes off */
+	void (*to_func)(void *arg);
+	void *to_arg;
+	struct timerwheel *volatile to_wheel; /* NULL when not pending */
+	volatile bool to_running;		/* to_func is being called */
+};
+
+struct timerwheel
+{
+	struct spinlock tw_lock;
+	unsigned tw_now;				/* next tick to run */
+	unsigned tw_count;				/* timeouts pending */
+	unsigned tw_fired;				/* timeouts run */
+	struct timeout *tw_slots[TW_LEVELS][TW_SLOTS];
+};
+
+/* Set up a cpu's wheel, and advance it by one tick (from hardclock) */
+void timerwheel_init(struct timerwheel *tw);
+void timerwheel_tick(struct timerwheel *tw);
+
+/* Set up a timeout to call FUNC(ARG) */
+void timeout_init(struct timeout *to, void (*func)(void *), void *arg);
+
+/*
+ * Make TO go off TICKS hardclocks from now (at the next one, if 0).
+ * TO must not be pending.
+ */
+void timeout_add(struct timeout *to, unsigned ticks);
+
+/*
+ * Cancel TO. Returns true if it was pending, false if it had gone off
+ * already (or was never added); in that case, if its function is
+ * running on another cpu, waits for it to return, so the caller must
+ * not hold any spinlock the function takes.
+ */
+bool timeout_cancel(struct timeout *to);
+
+#endif /* _TIMEOUT_H_ */
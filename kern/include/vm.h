@@ -49,6 +49,16 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/*
+ * Fault in the user pages of [BASE, BASE+LEN) of the current process,
+ * for writing if WRITE, and keep them resident until vm_unwire, so
+ * that I/O to them cannot fault. For system calls that pass user
+ * buffers straight to the file system. Returns EFAULT if the range is
+ * not valid user memory.
+ */
+int vm_wire(userptr_t base, size_t len, bool write);
+void vm_unwire(userptr_t base, size_t len);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
@@ -56,6 +66,19 @@ void free_kpages(vaddr_t addr);
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Print TLB fault/replacement/invalidation counters */
+void vm_tlbstats(void);
+
+/* Copy-on-write counters (options paging) */
+struct vm_cowstats
+{
+	unsigned long cs_forks;  /* address spaces copied */
+	unsigned long cs_shared; /* pages shared by those copies */
+	unsigned long cs_copied; /* pages copied on a write fault */
+	unsigned long cs_reused; /* COW pages written by their last sharer */
+};
+void vm_getcowstats(struct vm_cowstats *stats);
+
 #ifndef _BASIC_VM_DEALLOC_H_
 #define _BASIC_VM_DEALLOC_H_
 
@@ -35,7 +35,10 @@
  */
 
 
+#include <timeout.h>
+
 struct spinlock; /* in spinlock.h */
+struct thread; /* in thread.h */
 struct wchan; /* Opaque */
 
 /*
@@ -50,6 +53,12 @@ struct wchan *wchan_create(const char *name);
  */
 void wchan_destroy(struct wchan *wc);
 
+/*
+ * Change the name of a wait channel, for one kept in an object cache
+ * across uses. Same rules for NAME as for wchan_create.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -76,5 +85,33 @@ void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Timed sleeps. wchan_timeout_start, called with the spinlock held,
+ * arranges for the current thread to be woken up from WC after TICKS
+ * hardclocks, and for wt_expired (read with the spinlock held) to be
+ * set. Any number of wchan_sleeps on WC may follow. The caller then
+ * releases the spinlock and calls wchan_timeout_stop, which must be
+ * called before the wchan_timeout goes out of scope.
+ *
+ *	spinlock_acquire(lk);
+ *	wchan_timeout_start(&wt, wc, lk, ticks);
+ *	while (!condition && !wt.wt_expired) {
+ *		wchan_sleep(wc, lk);
+ *	}
+ *	spinlock_release(lk);
+ *	wchan_timeout_stop(&wt);
+ */
+struct wchan_timeout {
+	struct timeout wt_timeout;
+	struct thread *wt_thread;
+	struct wchan *wt_wchan;
+	struct spinlock *wt_lock;
+	volatile bool wt_expired;
+};
+
+void wchan_timeout_start(struct wchan_timeout *wt, struct wchan *wc,
+			 struct spinlock *lk, unsigned ticks);
+void wchan_timeout_stop(struct wchan_timeout *wt);
+
 
 #endif /* _WCHAN_H_ */
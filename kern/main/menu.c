@@ -43,8 +43,12 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <kmem_cache.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-paging.h"
+#include "opt-swap.h"
+#include "opt-file_system.h"
 
 #include <vm.h>
 
@@ -480,6 +484,29 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
+
+	return 0;
+}
+
+static int
+cmd_threadstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
+static int
+cmd_tlbstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_tlbstats();
 
 	return 0;
 }
@@ -514,6 +541,30 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static int
+cmd_kheapprofile(int nargs, char **args)
+{
+	if (nargs == 1)
+	{
+		kheap_profile_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on"))
+	{
+		kheap_profile_start();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off"))
+	{
+		kheap_profile_stop();
+		kheap_profile_print();
+	}
+	else
+	{
+		kprintf("Usage: khprof [on|off]\n");
+	}
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -580,16 +631,22 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] kfree with profiler on test   ",
+	"[km]  kfree latency benchmark       ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[wlb] Wakeup latency benchmark      ",
+	"[iwb] Idle wakeup benchmark         ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
+	"[lkb] Lock contention benchmark (1) ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
+	"[sy5] Timed wait test       (1)     ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
@@ -597,6 +654,16 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+#if OPT_FILE_SYSTEM
+	"[fwb] File write benchmark          ",
+	"[ofb] File open/close benchmark     ",
+#endif
+#if OPT_PAGING
+	"[fb]  Fork (COW) benchmark          ",
+#endif
+#if OPT_SWAP
+	"[swt] Swap test                     ",
+#endif
 	NULL};
 
 static int
@@ -619,6 +686,9 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap profiler       ",
+	"[tlbs] TLB stats                    ",
+	"[ths] Scheduler stats               ",
 	"[q] Quit and shut down              ",
 	NULL};
 
@@ -689,6 +759,9 @@ static struct
 	{"kh", cmd_kheapstats},
 	{"khgen", cmd_kheapgeneration},
 	{"khdump", cmd_kheapdump},
+	{"khprof", cmd_kheapprofile},
+	{"tlbs", cmd_tlbstats},
+	{"ths", cmd_threadstats},
 
 	/* base system tests */
 	{"at", arraytest},
@@ -699,18 +772,24 @@ static struct
 	{"km2", kmallocstress},
 	{"km3", kmalloctest3},
 	{"km4", kmalloctest4},
+	{"km5", kmalloctest5},
+	{"km", kmallocbench},
 #if OPT_NET
 	{"net", nettest},
 #endif
 	{"tt1", threadtest},
 	{"tt2", threadtest2},
 	{"tt3", threadtest3},
+	{"wlb", wakeuplatencybench},
+	{"iwb", idlewakeupbench},
 	{"sy1", semtest},
 
 	/* synchronization assignment tests */
 	{"sy2", locktest},
+	{"lkb", lockbench},
 	{"sy3", cvtest},
 	{"sy4", cvtest2},
+	{"sy5", timedwaittest},
 
 	/* semaphore unit tests */
 	{"semu1", semu1},
@@ -743,6 +822,16 @@ static struct
 	{"fs4", writestress2},
 	{"fs5", longstress},
 	{"fs6", createstress},
+#if OPT_FILE_SYSTEM
+	{"fwb", filewritebench},
+	{"ofb", openclosebench},
+#endif
+#if OPT_PAGING
+	{"fb", forkbench},
+#endif
+#if OPT_SWAP
+	{"swt", swaptest},
+#endif
 #if OPT_BASIC_VM_DEALLOC
 	/* custom menu options */
 	{"memstats", cmd_memstats},
@@ -43,14 +43,18 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <spl.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
+#include <kmem_cache.h>
 
 #if OPT_FILE_SYSTEM
 #include "opt-file_system.h"
+#include <kern/unistd.h>
+#include <syscall.h>
 #endif
 
 #if OPT_WAITPID_SYSCALL
@@ -77,6 +81,40 @@ struct proc *find_proc_by_pid(pid_t pid)
  */
 struct proc *kproc;
 
+/*
+ * Constructor and destructor of proc_cache: what stays in a proc
+ * structure from one process to the next.
+ */
+static int proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_init(&proc->p_lock);
+#if OPT_WAITPID_SYSCALL
+	proc->p_sem = sem_create("proc", 0);
+	if (proc->p_sem == NULL)
+	{
+		spinlock_cleanup(&proc->p_lock);
+		return ENOMEM;
+	}
+#endif
+	return 0;
+}
+
+static void proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+#if OPT_WAITPID_SYSCALL
+	sem_destroy(proc->p_sem);
+#endif
+	spinlock_cleanup(&proc->p_lock);
+}
+
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", sizeof(struct proc), 0,
+						   proc_ctor, proc_dtor);
+
 /*
  * Create a proc structure.
  */
@@ -85,7 +123,7 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL)
 	{
 		return NULL;
@@ -93,12 +131,12 @@ proc_create(const char *name)
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL)
 	{
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 
 	proc->p_numthreads = 0;
-	spinlock_init(&proc->p_lock);
+	/* p_lock is set up by proc_ctor */
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -133,12 +171,14 @@ proc_create(const char *name)
 
 		spinlock_release(&proc_table.lk);
 	}
-	proc->p_sem = sem_create(name, 0);
 	proc->p_exit_code = 0;
 #endif
 
 #if OPT_FILE_SYSTEM
 	bzero(proc->p_fileTable, OPEN_MAX * sizeof(struct openfile *));
+	bzero(proc->p_fdMap, sizeof(proc->p_fdMap));
+	/* stdin, stdout and stderr are the console, not in the table */
+	proc->p_fdMap[0] = (1U << (STDERR_FILENO + 1)) - 1;
 #endif
 
 	return proc;
@@ -175,6 +215,9 @@ void proc_destroy(struct proc *proc)
 		VOP_DECREF(proc->p_cwd);
 		proc->p_cwd = NULL;
 	}
+#if OPT_FILE_SYSTEM
+	proc_file_table_close(proc);
+#endif
 
 	/* VM fields */
 	if (proc->p_addrspace)
@@ -228,9 +271,12 @@ void proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_numthreads == 0);
-	spinlock_cleanup(&proc->p_lock);
+	/* p_lock and p_sem stay for the next proc_create */
 
 #if OPT_WAITPID_SYSCALL
+	/* a proc nobody waited for left it at 1 */
+	sem_reset(proc->p_sem, 0);
+
 	spinlock_acquire(&proc_table.lk);
 	KASSERT(proc->p_pid >= 0 && proc->p_pid < MAX_PROC);
 	proc_table.processes[proc->p_pid] = NULL;
@@ -239,7 +285,7 @@ void proc_destroy(struct proc *proc)
 #endif
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 }
 
 /*
@@ -409,23 +455,3 @@ int proc_wait(struct proc *p)
 }
 #endif
 
-/*
-
-#if OPT_FILE_SYSTEM
-void proc_file_table_copy(struct proc *psrc, struct proc *pdest)
-{
-	int fd;
-	for (fd = 0; fd < OPEN_MAX; fd++)
-	{
-		struct openfile *of = psrc->fileTable[fd];
-		pdest->fileTable[fd] = of;
-		if (of != NULL)
-		{
-			incr reference count
-			openfileIncrRefCount(of);
-		}
-	}
-}
-#endif
-
-*/
\ No newline at end of file
@@ -13,6 +13,7 @@ It returns -1 if an error occurs
 
 #include <types.h>		 // userptr_t, size_t
 #include <kern/unistd.h> // STDOUT_FILENO, STDERR_FILENO
+#include <kern/errno.h>	 // ENOSYS, EBADF
 #include <lib.h>		 // kprintf, putch
 #include <kern/syscall.h>
 #include <syscall.h>
@@ -20,7 +21,6 @@ It returns -1 if an error occurs
 #if OPT_FILE_SYSTEM
 #include <limits.h>		// OPEN_MAX
 #include <vfs.h>		//vfs_open
-#include <kern/errno.h> //ENOENT
 #include <current.h>	//curproc
 #include <proc.h>
 
@@ -28,6 +28,11 @@ It returns -1 if an error occurs
 #include <kern/iovec.h>
 #include <vnode.h>
 #include <copyinout.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
+#include <vm.h>
 
 /* max num of system wide open files */
 #define SYSTEM_OPEN_MAX (10 * OPEN_MAX)
@@ -37,136 +42,340 @@ struct openfile
 	struct vnode *vn;
 	off_t offset;
 	unsigned int refCount;
-	// int lock; possiamo aggiungere accesso in mutua esclusione in futuro
+	struct lock *lock;			 // serializza l'uso di offset
+	struct openfile *nextFree; // nella free list di systemFileTable
 };
 
-struct openfile systemFileTable[SYSTEM_OPEN_MAX];
 /*
+ * Allocatore degli openfile: gli elementi liberi di systemFileTable
+ * sono in una free list, quelli mai usati stanno oltre
+ * systemFileTableUsed, quindi open e close sono O(1). Il lock di un
+ * elemento viene creato al primo uso e resta quando l'elemento torna
+ * libero.
+ *
+ * systemFileTableLock protegge la free list e i refCount: incremento
+ * e decremento sono atomici rispetto a close e fork concorrenti.
+ * La tabella dei fd di un processo (p_fileTable e la bitmap p_fdMap)
+ * è protetta da p_lock.
+ */
+static struct openfile systemFileTable[SYSTEM_OPEN_MAX];
+static struct openfile *systemFileTableFree;
+static unsigned systemFileTableUsed;
+static struct spinlock systemFileTableLock = SPINLOCK_INITIALIZER;
+
+static struct openfile *openfileAlloc(struct vnode *vn)
+{
+	struct openfile *of;
+
+	spinlock_acquire(&systemFileTableLock);
+	of = systemFileTableFree;
+	if (of != NULL)
+	{
+		systemFileTableFree = of->nextFree;
+	}
+	else if (systemFileTableUsed < SYSTEM_OPEN_MAX)
+	{
+		of = &systemFileTable[systemFileTableUsed++];
+	}
+	spinlock_release(&systemFileTableLock);
+	if (of == NULL)
+	{
+		return NULL;
+	}
+
+	if (of->lock == NULL)
+	{
+		of->lock = lock_create("openfile");
+		if (of->lock == NULL)
+		{
+			spinlock_acquire(&systemFileTableLock);
+			of->nextFree = systemFileTableFree;
+			systemFileTableFree = of;
+			spinlock_release(&systemFileTableLock);
+			return NULL;
+		}
+	}
+	of->vn = vn;
+	of->offset = 0; // TODO: handle offset with append (offset != 0)
+	of->refCount = 1;
+	of->nextFree = NULL;
+	return of;
+}
 
 void openfileIncrRefCount(struct openfile *of)
 {
+	spinlock_acquire(&systemFileTableLock);
+	KASSERT(of->refCount > 0);
+	of->refCount++;
+	spinlock_release(&systemFileTableLock);
+}
+
+/* All'ultimo riferimento chiude il vnode e libera l'openfile */
+void openfileDecrRefCount(struct openfile *of)
+{
+	struct vnode *vn = NULL;
+
+	spinlock_acquire(&systemFileTableLock);
+	KASSERT(of->refCount > 0);
+	of->refCount--;
+	if (of->refCount == 0)
+	{
+		vn = of->vn;
+		of->vn = NULL;
+		of->nextFree = systemFileTableFree;
+		systemFileTableFree = of;
+	}
+	spinlock_release(&systemFileTableLock);
+
+	if (vn != NULL)
+	{
+		vfs_close(vn);
+	}
+}
+
+/*
+ * Openfile del fd FD del processo corrente, con un riferimento in più
+ * (da rilasciare con openfileDecrRefCount), o NULL. Così una close
+ * concorrente non lo libera mentre è in uso.
+ */
+static struct openfile *openfileGet(int fd)
+{
+	struct openfile *of;
+
+	if (fd < 0 || fd >= OPEN_MAX)
+		return NULL;
+	spinlock_acquire(&curproc->p_lock);
+	of = curproc->p_fileTable[fd];
 	if (of != NULL)
-		of->countRef++;
+	{
+		openfileIncrRefCount(of);
+	}
+	spinlock_release(&curproc->p_lock);
+	return of;
 }
 
-*/
+/*
+ * Mette OF nel fd libero più basso di P (oltre a stdin/out/err, che
+ * restano segnati occupati nella bitmap). Restituisce il fd, o -1 se
+ * la tabella è piena.
+ */
+static int fdAlloc(struct proc *p, struct openfile *of)
+{
+	unsigned w, bit;
+	int fd = -1;
+
+	spinlock_acquire(&p->p_lock);
+	for (w = 0; w < OPEN_MAX / 32; w++)
+	{
+		if (p->p_fdMap[w] != 0xffffffff)
+		{
+			bit = __builtin_ctz(~p->p_fdMap[w]);
+			p->p_fdMap[w] |= 1U << bit;
+			fd = w * 32 + bit;
+			KASSERT(p->p_fileTable[fd] == NULL);
+			p->p_fileTable[fd] = of;
+			break;
+		}
+	}
+	spinlock_release(&p->p_lock);
+	return fd;
+}
+
+/* Toglie il fd FD da P; restituisce il suo openfile o NULL */
+static struct openfile *fdFree(struct proc *p, int fd)
+{
+	struct openfile *of;
+
+	spinlock_acquire(&p->p_lock);
+	of = p->p_fileTable[fd];
+	if (of != NULL)
+	{
+		p->p_fileTable[fd] = NULL;
+		p->p_fdMap[fd / 32] &= ~(1U << (fd % 32));
+	}
+	spinlock_release(&p->p_lock);
+	return of;
+}
+
+/* Chiude tutti i fd di P (alla distruzione del processo) */
+void proc_file_table_close(struct proc *p)
+{
+	struct openfile *of;
+	int fd;
+
+	for (fd = 0; fd < OPEN_MAX; fd++)
+	{
+		of = fdFree(p, fd);
+		if (of != NULL)
+		{
+			openfileDecrRefCount(of);
+		}
+	}
+}
 
 int sys_open(userptr_t pathname, int flags, mode_t mode, int *errp)
 {
-	/* 1. Crea nuovo openfile */
-	struct openfile *of = NULL;
+	struct openfile *of;
 	struct vnode *vn;
-	int result = 0;
+	int fd, result;
+
 	// int vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 	result = vfs_open((char *)pathname, flags, mode, &vn);
 	if (result)
 	{
-		*errp = ENOENT;
-		vfs_close(vn);
+		*errp = result;
 		return -1;
 	}
-	/* 2. Inserisco struct openfile dentro systemFileTable (cercando prima posizione vuota nella tabella) */
-	for (int i = 0; i < SYSTEM_OPEN_MAX; i++)
-	{
-		if (systemFileTable[i].vn == NULL)
-		{
-			of = &systemFileTable[i];
-			of->vn = vn;
-			of->offset = 0; // TODO: handle offset with append (offset != 0)
-			of->refCount = 1;
-			break;
-		}
-	}
+	/* 1. Crea nuovo openfile (dalla free list di systemFileTable) */
+	of = openfileAlloc(vn);
 	if (of == NULL)
 	{
 		// no free slot in system open file table
 		*errp = ENFILE;
+		vfs_close(vn);
+		return -1;
 	}
-	else
+	/* 2. Inserisco puntatore alla struct openfile nel fd libero più basso */
+	fd = fdAlloc(curproc, of);
+	if (fd < 0)
 	{
-		/* 3. Inserisco puntatore alla struct openfile dentro p_fileTable */
-		for (int fd = STDERR_FILENO + 1; fd < OPEN_MAX; fd++)
-		{
-			if (curproc->p_fileTable[fd] == NULL)
-			{
-				curproc->p_fileTable[fd] = of;
-				return fd;
-			}
-		}
 		// no free slot in process open file table
 		*errp = EMFILE;
+		openfileDecrRefCount(of); // chiude anche vn
+		return -1;
 	}
-	vfs_close(vn);
-	return -1;
+	return fd;
+}
+
+/*
+ * Dopo la fork il figlio condivide con il padre gli openfile (e quindi
+ * gli offset): niente vfs_open, basta un riferimento in più per fd.
+ */
+void proc_file_table_copy(struct proc *psrc, struct proc *pdest)
+{
+	int fd;
+
+	spinlock_acquire(&psrc->p_lock);
+	for (fd = 0; fd < OPEN_MAX; fd++)
+	{
+		struct openfile *of = psrc->p_fileTable[fd];
+		KASSERT(pdest->p_fileTable[fd] == NULL);
+		pdest->p_fileTable[fd] = of;
+		if (of != NULL)
+		{
+			openfileIncrRefCount(of);
+		}
+	}
+	memcpy(pdest->p_fdMap, psrc->p_fdMap, sizeof(psrc->p_fdMap));
+	spinlock_release(&psrc->p_lock);
 }
 
 int sys_close(int fd)
 {
-	if (fd < 0 || fd > OPEN_MAX)
+	if (fd < 0 || fd >= OPEN_MAX)
 		return -1;
-	/* 1. Ottengo openfile da processFileTable  */
-	struct openfile *of = curproc->p_fileTable[fd];
+	/* 1. Tolgo openfile da processFileTable  */
+	struct openfile *of = fdFree(curproc, fd);
 	if (of == NULL)
 		return -1;
 
-	/* 2. Nullo openfile* da processFileTable */
-	curproc->p_fileTable[fd] = NULL;
-	/* 3. Diminuisco countref  */
-	of->refCount--;
-	if (of->refCount > 0)
-		return 0;
-	/* 4. Se countref arriva a 0, elimino openfile in systemFileTable (systemFileTable[i].vn = NULL)) */
-	struct vnode *vn = of->vn;
-	if (vn == NULL)
-		return -1;
-	of->vn = NULL; // equivalent to (systemFileTable[i].vn = NULL) since we have the pointer to that openfile
+	/* 2. Diminuisco countref: a 0 libera l'openfile e chiude il vnode */
+	openfileDecrRefCount(of);
+	return 0;
+}
+
+/*
+ * Le uio puntano direttamente ai buffer utente, e un file system può
+ * tenere un suo lock durante uiomove (emufs lo fa): un page fault su
+ * una pagina dell'eseguibile non ancora caricata rileggerebbe il file
+ * e si bloccherebbe su quel lock. Quindi i buffer vengono portati in
+ * memoria e fissati (vm_wire) prima della VOP_READ/VOP_WRITE, e
+ * rilasciati dopo. Una read scrive nei buffer.
+ */
+static void file_unwire(struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		vm_unwire(iov[i].iov_ubase, iov[i].iov_len);
+}
+
+static int file_wire(struct iovec *iov, int iovcnt, enum uio_rw rw)
+{
+	int i, result;
 
-	/* 5. Chiudo vnode con vfs_close  */
-	vfs_close(vn);
+	for (i = 0; i < iovcnt; i++)
+	{
+		result = vm_wire(iov[i].iov_ubase, iov[i].iov_len,
+						 rw == UIO_READ);
+		if (result)
+		{
+			file_unwire(iov, i);
+			return result;
+		}
+	}
 	return 0;
 }
 
-static long file_write(int fd, userptr_t buf, size_t count)
+static int file_write(int fd, userptr_t buf, size_t count, int32_t *retval)
 {
-	if (fd < 0 || fd > OPEN_MAX)
-		return -1;
 	/* 1. Ottengo openfile da processFileTable  */
-	struct openfile *of = curproc->p_fileTable[fd];
+	struct openfile *of = openfileGet(fd);
 	if (of == NULL)
-		return -1;
+		return EBADF;
 	struct vnode *vn = of->vn;
-	if (vn == NULL)
-		return -1;
 
-	struct uio ku;
+	/*
+	 * Come in file_read: la uio punta direttamente al buffer utente,
+	 * e uiomove copia i dati una volta sola dall'address space del
+	 * processo al file system. Niente buffer kernel (kmalloc(count) +
+	 * copyin): niente doppia copia, nessun limite dato dal kmalloc e
+	 * niente da liberare in caso di errore.
+	 */
+	struct uio u;
 	struct iovec iov;
 
-	// Se usiamo memoria kernel possiamo sfruttare uio_kinit, altrimenti stessa strategia di prima
-	void *kbuf = kmalloc(count);
-	copyin(buf, kbuf, count); // copy semantics!
+	iov.iov_ubase = buf;
+	iov.iov_len = count;
+
+	u.uio_iov = &iov;
+	u.uio_iovcnt = 1;
+	u.uio_resid = count;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = UIO_WRITE;
+	u.uio_space = curproc->p_addrspace;
 
-	uio_kinit(&iov, &ku, kbuf, count, of->offset, UIO_WRITE);
-	int result = VOP_WRITE(vn, &ku);
+	int result = file_wire(&iov, 1, UIO_WRITE);
 	if (result)
 	{
+		openfileDecrRefCount(of);
 		return result;
 	}
-	kfree(kbuf);
-	of->offset = ku.uio_offset;
-	return count - ku.uio_resid;
+	lock_acquire(of->lock);
+	u.uio_offset = of->offset;
+	result = VOP_WRITE(vn, &u);
+	if (result == 0)
+	{
+		of->offset = u.uio_offset;
+	}
+	lock_release(of->lock);
+	file_unwire(&iov, 1);
+	openfileDecrRefCount(of);
+	if (result)
+	{
+		return result;
+	}
+	*retval = count - u.uio_resid;
+	return 0;
 }
-static long file_read(int fd, userptr_t buf, size_t count)
+static int file_read(int fd, userptr_t buf, size_t count, int32_t *retval)
 {
-	if (fd < 0 || fd > OPEN_MAX)
-		return -1;
 	/* 1. Ottengo openfile da processFileTable  */
-	struct openfile *of = curproc->p_fileTable[fd];
+	struct openfile *of = openfileGet(fd);
 	if (of == NULL)
-		return -1;
+		return EBADF;
 	/* 2. Ricavo vnode riferito da quell'openfile */
 	struct vnode *vn = of->vn;
-	if (vn == NULL)
-		return -1;
 
 	/* 3. Preparo uio struct adeguata per la lettura che voglio fare */
 	struct uio u;
@@ -194,7 +403,6 @@ static long file_read(int fd, userptr_t buf, size_t count)
 
 	u.uio_iov = &iov;
 	u.uio_iovcnt = 1;
-	u.uio_offset = of->offset;
 	u.uio_resid = count; // amount to read from the file
 	/*
 	enum uio_seg {
@@ -211,13 +419,327 @@ static long file_read(int fd, userptr_t buf, size_t count)
 	u.uio_space = as;
 
 	/* 4. Leggo da vn all'address space del processo */
-	int result = VOP_READ(vn, &u);
+	int result = file_wire(&iov, 1, UIO_READ);
+	if (result)
+	{
+		openfileDecrRefCount(of);
+		return result;
+	}
+	lock_acquire(of->lock);
+	u.uio_offset = of->offset;
+	result = VOP_READ(vn, &u);
+	if (result == 0)
+	{
+		of->offset = u.uio_offset;
+	}
+	lock_release(of->lock);
+	file_unwire(&iov, 1);
+	openfileDecrRefCount(of);
 	if (result)
 	{
 		return result;
 	}
-	of->offset = u.uio_offset;
-	return (count - u.uio_resid);
+	*retval = count - u.uio_resid;
+	return 0;
+}
+
+/*
+ * I/O vettoriale: readv/writev (e preadv/pwritev, che usano l'offset
+ * dato invece di quello dell'openfile e non lo spostano).
+ *
+ * L'array di iovec viene copiato nel kernel, poi tutti i buffer utente
+ * diventano un'unica uio con uio_iovcnt iovec: una sola VOP_READ o
+ * VOP_WRITE per tutta la richiesta, uiomove passa da un buffer
+ * all'altro. Queste chiamate restituiscono un codice d'errore e il
+ * numero di byte in *retval, come sys_fork.
+ *
+ * pread/pwrite sono il caso con un solo iovec: non leggono né
+ * scrivono of->offset, quindi thread o processi che condividono
+ * l'openfile possono leggere in parallelo senza lseek.
+ */
+
+/* iovec tenuti sullo stack; oltre si usa kmalloc */
+#define FILE_FASTIOV 8
+
+/*
+ * Console (stdin/stdout/stderr non sono nella p_fileTable): un
+ * sys_read o sys_write per ogni iovec.
+ */
+static int file_console_rwv(int fd, struct iovec *iov, int iovcnt,
+							enum uio_rw rw, int32_t *retval)
+{
+	int32_t n;
+	size_t done = 0;
+	int i, result;
+
+	for (i = 0; i < iovcnt; i++)
+	{
+		if (rw == UIO_READ)
+			result = sys_read(fd, iov[i].iov_ubase, iov[i].iov_len, &n);
+		else
+			result = sys_write(fd, iov[i].iov_ubase, iov[i].iov_len, &n);
+		if (result)
+		{
+			if (done == 0)
+				return result;
+			break; // restituisco quanto già trasferito
+		}
+		done += n;
+		if ((size_t)n < iov[i].iov_len)
+			break; // lettura corta (es. fine riga)
+	}
+	*retval = done;
+	return 0;
+}
+
+/*
+ * Legge o scrive i buffer utente IOV[0..IOVCNT) (già nel kernel, per
+ * TOTAL byte in tutto) sul file FD, all'offset OFFSET se USEOFFSET,
+ * altrimenti a quello dell'openfile.
+ */
+static int file_dorw(int fd, struct iovec *iov, int iovcnt, size_t total,
+					 off_t offset, bool useoffset, enum uio_rw rw,
+					 int32_t *retval)
+{
+	struct openfile *of;
+	struct vnode *vn;
+	struct uio u;
+	int result;
+
+	if (fd < 0 || fd >= OPEN_MAX)
+		return EBADF;
+	if (useoffset && offset < 0)
+		return EINVAL;
+
+	/* 1. Ottengo openfile e vnode */
+	of = openfileGet(fd);
+	if (of == NULL)
+	{
+		if (!useoffset &&
+			((rw == UIO_READ && fd == STDIN_FILENO) ||
+			 (rw == UIO_WRITE &&
+			  (fd == STDOUT_FILENO || fd == STDERR_FILENO))))
+			return file_console_rwv(fd, iov, iovcnt, rw, retval);
+		return useoffset && fd <= STDERR_FILENO ? ESPIPE : EBADF;
+	}
+	vn = of->vn;
+	if (useoffset && !VOP_ISSEEKABLE(vn))
+	{
+		openfileDecrRefCount(of);
+		return ESPIPE;
+	}
+
+	/* 2. Una uio su tutti i buffer utente */
+	u.uio_iov = iov;
+	u.uio_iovcnt = iovcnt;
+	u.uio_offset = offset;
+	u.uio_resid = total;
+	u.uio_segflg = UIO_USERSPACE;
+	u.uio_rw = rw;
+	u.uio_space = curproc->p_addrspace;
+	result = file_wire(iov, iovcnt, rw);
+	if (result)
+	{
+		openfileDecrRefCount(of);
+		return result;
+	}
+
+	/*
+	 * 3. Una sola operazione sul vnode; pread/pwrite non prendono il
+	 * lock dell'openfile, perché non ne usano l'offset.
+	 */
+	if (!useoffset)
+	{
+		lock_acquire(of->lock);
+		u.uio_offset = of->offset;
+	}
+	if (rw == UIO_READ)
+		result = VOP_READ(vn, &u);
+	else
+		result = VOP_WRITE(vn, &u);
+	if (!useoffset)
+	{
+		if (result == 0)
+			of->offset = u.uio_offset;
+		lock_release(of->lock);
+	}
+	file_unwire(iov, iovcnt);
+	openfileDecrRefCount(of);
+	if (result)
+		return result;
+	*retval = total - u.uio_resid;
+	return 0;
+}
+
+static int file_rwv(int fd, userptr_t uiov, int iovcnt, off_t offset,
+					bool useoffset, enum uio_rw rw, int32_t *retval)
+{
+	struct iovec fastiov[FILE_FASTIOV];
+	struct iovec *iov = fastiov;
+	size_t total = 0;
+	int i, result;
+
+	if (iovcnt <= 0 || iovcnt > IOV_MAX)
+		return EINVAL;
+
+	/* Copio l'array di iovec nel kernel */
+	if (iovcnt > FILE_FASTIOV)
+	{
+		iov = kmalloc(iovcnt * sizeof(struct iovec));
+		if (iov == NULL)
+			return ENOMEM;
+	}
+	result = copyin(uiov, iov, iovcnt * sizeof(struct iovec));
+	if (result)
+		goto out;
+	for (i = 0; i < iovcnt; i++)
+	{
+		/* la somma deve stare nel valore di ritorno */
+		if (iov[i].iov_len > (size_t)0x7fffffff - total)
+		{
+			result = EINVAL;
+			goto out;
+		}
+		total += iov[i].iov_len;
+	}
+
+	result = file_dorw(fd, iov, iovcnt, total, offset, useoffset, rw,
+					   retval);
+out:
+	if (iov != fastiov)
+		kfree(iov);
+	return result;
+}
+
+/*
+ * dup2: NEWFD diventa un altro riferimento all'openfile di OLDFD
+ * (stesso offset); se NEWFD era aperto, viene chiuso. Anche 0, 1 e 2
+ * possono essere ridiretti su un file: sys_read/sys_write usano il
+ * file se c'è.
+ */
+int sys_dup2(int oldfd, int newfd, int32_t *retval)
+{
+	struct openfile *of, *old;
+
+	if (oldfd < 0 || oldfd >= OPEN_MAX || newfd < 0 || newfd >= OPEN_MAX)
+		return EBADF;
+
+	spinlock_acquire(&curproc->p_lock);
+	of = curproc->p_fileTable[oldfd];
+	if (of == NULL)
+	{
+		spinlock_release(&curproc->p_lock);
+		return EBADF;
+	}
+	old = NULL;
+	if (oldfd != newfd)
+	{
+		openfileIncrRefCount(of);
+		old = curproc->p_fileTable[newfd];
+		curproc->p_fileTable[newfd] = of;
+		curproc->p_fdMap[newfd / 32] |= 1U << (newfd % 32);
+	}
+	spinlock_release(&curproc->p_lock);
+
+	/* fuori dallo spinlock: può chiudere il vnode */
+	if (old != NULL)
+		openfileDecrRefCount(old);
+	*retval = newfd;
+	return 0;
+}
+
+/*
+ * lseek: sposta l'offset condiviso dell'openfile, sotto il suo lock.
+ */
+int sys_lseek(int fd, off_t pos, int whence, off_t *retval)
+{
+	struct openfile *of;
+	struct stat st;
+	off_t newpos;
+	int result = 0;
+
+	of = openfileGet(fd);
+	if (of == NULL)
+		return fd >= 0 && fd <= STDERR_FILENO ? ESPIPE : EBADF;
+	if (!VOP_ISSEEKABLE(of->vn))
+	{
+		openfileDecrRefCount(of);
+		return ESPIPE;
+	}
+
+	lock_acquire(of->lock);
+	switch (whence)
+	{
+	case SEEK_SET:
+		newpos = pos;
+		break;
+	case SEEK_CUR:
+		newpos = of->offset + pos;
+		break;
+	case SEEK_END:
+		result = VOP_STAT(of->vn, &st);
+		newpos = st.st_size + pos;
+		break;
+	default:
+		result = EINVAL;
+		break;
+	}
+	if (result == 0 && newpos < 0)
+		result = EINVAL;
+	if (result == 0)
+	{
+		of->offset = newpos;
+		*retval = newpos;
+	}
+	lock_release(of->lock);
+	openfileDecrRefCount(of);
+	return result;
+}
+
+int sys_readv(int fd, userptr_t iov, int iovcnt, int32_t *retval)
+{
+	return file_rwv(fd, iov, iovcnt, 0, false, UIO_READ, retval);
+}
+
+int sys_writev(int fd, userptr_t iov, int iovcnt, int32_t *retval)
+{
+	return file_rwv(fd, iov, iovcnt, 0, false, UIO_WRITE, retval);
+}
+
+int sys_preadv(int fd, userptr_t iov, int iovcnt, off_t offset,
+			   int32_t *retval)
+{
+	return file_rwv(fd, iov, iovcnt, offset, true, UIO_READ, retval);
+}
+
+int sys_pwritev(int fd, userptr_t iov, int iovcnt, off_t offset,
+				int32_t *retval)
+{
+	return file_rwv(fd, iov, iovcnt, offset, true, UIO_WRITE, retval);
+}
+
+int sys_pread(int fd, userptr_t buf, size_t count, off_t offset,
+			  int32_t *retval)
+{
+	struct iovec iov;
+
+	if (count > (size_t)0x7fffffff)
+		return EINVAL;
+	iov.iov_ubase = buf;
+	iov.iov_len = count;
+	return file_dorw(fd, &iov, 1, count, offset, true, UIO_READ, retval);
+}
+
+int sys_pwrite(int fd, userptr_t buf, size_t count, off_t offset,
+			   int32_t *retval)
+{
+	struct iovec iov;
+
+	if (count > (size_t)0x7fffffff)
+		return EINVAL;
+	iov.iov_ubase = buf;
+	iov.iov_len = count;
+	return file_dorw(fd, &iov, 1, count, offset, true, UIO_WRITE, retval);
 }
 #endif
 
@@ -228,20 +750,25 @@ buf points to a character array, with content to be written to the file pointed
 
 nbytes specifies the number of bytes to be written from the character array into the file pointed to by fd
 */
-long sys_write(int fd, userptr_t buf, size_t nbytes)
+int sys_write(int fd, userptr_t buf, size_t nbytes, int32_t *retval)
 {
 	char *data = (char *)buf;
 	size_t i;
 
-	if (fd != STDOUT_FILENO && fd != STDERR_FILENO)
-	{
 #if OPT_FILE_SYSTEM
-		return file_write(fd, buf, nbytes);
+	/* anche stdout/stderr, se dup2 li ha ridiretti su un file */
+	if ((fd != STDOUT_FILENO && fd != STDERR_FILENO) ||
+		curproc->p_fileTable[fd] != NULL)
+	{
+		return file_write(fd, buf, nbytes, retval);
+	}
 #else
+	if (fd != STDOUT_FILENO && fd != STDERR_FILENO)
+	{
 		kprintf("sys_write supported only to stdout and stderr\n");
-		return -1;
-#endif
+		return ENOSYS;
 	}
+#endif
 
 	// kprintf("Hi! :) I'm sys_write and I'm about to write what you asked:\n");
 
@@ -250,7 +777,8 @@ long sys_write(int fd, userptr_t buf, size_t nbytes)
 		putch(data[i]);
 	}
 
-	return i;
+	*retval = i;
+	return 0;
 }
 
 /* static void
@@ -300,20 +828,24 @@ The value returned is the number of bytes read (zero indicates end of file) and
 
 Alternatively, -1 is returned when an error occurs, in such a case errno is set appropriately and further it is left unspecified whether the file position (if any) changes.
 */
-long sys_read(int fd, userptr_t buf, size_t count)
+int sys_read(int fd, userptr_t buf, size_t count, int32_t *retval)
 {
 	char *data = (char *)buf;
 	size_t i;
 
-	if (fd != STDIN_FILENO)
-	{
 #if OPT_FILE_SYSTEM
-		return file_read(fd, buf, count);
+	/* anche stdin, se dup2 lo ha ridiretto su un file */
+	if (fd != STDIN_FILENO || curproc->p_fileTable[fd] != NULL)
+	{
+		return file_read(fd, buf, count, retval);
+	}
 #else
+	if (fd != STDIN_FILENO)
+	{
 		kprintf("sys_read supported only from stdin\n");
-		return -1;
-#endif
+		return ENOSYS;
 	}
+#endif
 
 	// kprintf("Hi! :) I'm sys_read and I'm about to read what you asked:\n");
 
@@ -323,8 +855,9 @@ long sys_read(int fd, userptr_t buf, size_t count)
 		// In the C standard library, the character reading functions such as getchar return a value equal to the symbolic value (macro) EOF to indicate that an end-of-file condition has occurred. The actual value of EOF is implementation-dependent and must be negative (but is commonly −1, such as in glibc[2]). stdio.h non c'è nel kernel.
 
 		if (data[i] < 0)
-			return i;
+			break;
 	}
 
-	return i;
+	*retval = i;
+	return 0;
 }
@@ -74,6 +74,7 @@
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
  */
+#if !OPT_LAZY_ELF
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -144,6 +145,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 
 	return result;
 }
+#endif /* !OPT_LAZY_ELF */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -288,9 +290,22 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_LAZY_ELF
+		/*
+		 * Don't read anything yet: vm_fault brings each page
+		 * in from the file the first time it is touched.
+		 */
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		result = as_define_file(as, ph.p_vaddr, v, ph.p_offset,
+					ph.p_filesz);
+#else
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#endif
 		if (result) {
 			return result;
 		}
@@ -95,7 +95,10 @@ int sys_fork(struct trapframe *ctf, pid_t *retval)
 		return ENOMEM;
 	}
 
-	// TODO: add shared open files: proc_file_table_copy(newp,curproc);
+#if OPT_FILE_SYSTEM
+	/* the child shares the parent's open files */
+	proc_file_table_copy(curproc, newp);
+#endif
 	/* we need a copy of the parent's trapframe */
 	tf_child = kmalloc(sizeof(struct trapframe));
 	if (tf_child == NULL)
@@ -28,7 +28,9 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <clock.h>
+#include <timeout.h>
 #include <copyinout.h>
 #include <syscall.h>
 
@@ -56,3 +58,47 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the time in *user_req. It is rounded up to whole
+ * hardclocks, plus one for the period already under way, so the sleep
+ * is never shorter than asked. Nothing interrupts it, so the time
+ * left, stored in *user_rem if it's not NULL, is always zero.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec ts;
+	uint64_t ticks;
+	unsigned n;
+	int result;
+
+	result = copyin(user_req, &ts, sizeof(ts));
+	if (result) {
+		return result;
+	}
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	ticks = (uint64_t)ts.tv_sec * HZ +
+		((uint64_t)ts.tv_nsec * HZ + 999999999) / 1000000000;
+	if (ticks > 0) {
+		ticks++;
+	}
+	while (ticks > 0) {
+		n = ticks > TIMEOUT_MAXTICKS ? TIMEOUT_MAXTICKS : ticks;
+		thread_sleep_ticks(n);
+		ticks -= n;
+	}
+
+	if (user_rem != NULL) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		result = copyout(&ts, user_rem, sizeof(ts));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
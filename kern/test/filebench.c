@@ -0,0 +1,277 @@
+/*
+ * File system call benchmarks.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <test.h>
+
+////////////////////////////////////////////////////////////
+// fwb: file write benchmark
+
+/*
+ * Write FWB_TOTAL bytes to a file with write sizes from 4 KB to 1 MB,
+ * in two ways:
+ *
+ *   copy:   the way file_write used to do it, kmalloc(count) and
+ *           copyin of the whole user buffer, then VOP_WRITE from the
+ *           kernel buffer;
+ *   direct: sys_write, whose uio points at the user buffer, so the
+ *           data is moved once, by uiomove.
+ *
+ * The buffer is in a user address space installed in the current
+ * (kernel) process, as in fb, and is filled before timing starts.
+ */
+
+#define FWB_VBASE 0x400000
+#define FWB_MINSIZE (4 * 1024)
+#define FWB_MAXSIZE (1024 * 1024)
+#define FWB_TOTAL (4 * 1024 * 1024)
+#define FWB_FILE "emu0:fwbench.tmp"
+
+/* Write TOTAL bytes from UBUF in chunks of SIZE, the old way */
+static int fwb_copy(userptr_t ubuf, size_t size, size_t total)
+{
+	char name[32];
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	void *kbuf;
+	off_t offset = 0;
+	int result;
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(name, FWB_FILE);
+	result = vfs_open(name, O_WRONLY | O_CREAT | O_TRUNC, 0664, &vn);
+	if (result)
+	{
+		return result;
+	}
+	while (offset < (off_t)total)
+	{
+		kbuf = kmalloc(size);
+		if (kbuf == NULL)
+		{
+			result = ENOMEM;
+			break;
+		}
+		result = copyin(ubuf, kbuf, size);
+		if (result == 0)
+		{
+			uio_kinit(&iov, &ku, kbuf, size, offset, UIO_WRITE);
+			result = VOP_WRITE(vn, &ku);
+			offset = ku.uio_offset;
+		}
+		kfree(kbuf);
+		if (result)
+		{
+			break;
+		}
+	}
+	vfs_close(vn);
+	return result;
+}
+
+/* Write TOTAL bytes from UBUF in chunks of SIZE with sys_write */
+static int fwb_direct(userptr_t ubuf, size_t size, size_t total)
+{
+	char name[32];
+	size_t done = 0;
+	int32_t n;
+	int fd, err = 0;
+
+	strcpy(name, FWB_FILE);
+	fd = sys_open((userptr_t)name, O_WRONLY | O_CREAT | O_TRUNC, 0664,
+				  &err);
+	if (fd < 0)
+	{
+		return err;
+	}
+	while (done < total)
+	{
+		err = sys_write(fd, ubuf, size, &n);
+		if (err)
+		{
+			break;
+		}
+		if ((size_t)n != size)
+		{
+			err = EIO;
+			break;
+		}
+		done += n;
+	}
+	sys_close(fd);
+	return err;
+}
+
+/* Print the throughput of TOTAL bytes in the time from TS1 to TS2 */
+static void fwb_report(const char *how, size_t size, size_t total,
+					   struct timespec *ts1, struct timespec *ts2)
+{
+	struct timespec ts;
+	uint64_t usecs;
+
+	timespec_sub(ts2, ts1, &ts);
+	usecs = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	if (usecs == 0)
+	{
+		usecs = 1;
+	}
+	kprintf("  %-6s %5lu KB writes: %4lu.%03lu s, %6llu KB/s\n", how,
+			(unsigned long)size / 1024,
+			(unsigned long)ts.tv_sec,
+			(unsigned long)ts.tv_nsec / 1000000,
+			(unsigned long long)total * 1000000 / 1024 / usecs);
+}
+
+int filewritebench(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	struct timespec ts1, ts2;
+	userptr_t ubuf = (userptr_t)FWB_VBASE;
+	size_t size, i;
+	int result;
+
+	(void)args;
+	if (nargs > 1)
+	{
+		kprintf("Usage: fwb\n");
+		return EINVAL;
+	}
+
+	as = as_create();
+	if (as == NULL)
+	{
+		return ENOMEM;
+	}
+	result = as_define_region(as, FWB_VBASE, FWB_MAXSIZE, 1, 1, 0);
+	if (result == 0)
+	{
+		result = as_prepare_load(as);
+	}
+	if (result == 0)
+	{
+		result = as_complete_load(as);
+	}
+	if (result)
+	{
+		as_destroy(as);
+		return result;
+	}
+	oldas = proc_setas(as);
+	as_activate();
+
+	for (i = 0; i < FWB_MAXSIZE; i++)
+	{
+		((volatile char *)FWB_VBASE)[i] = 'a' + i % 26;
+	}
+
+	kprintf("Writing %u KB to %s:\n", FWB_TOTAL / 1024, FWB_FILE);
+	for (size = FWB_MINSIZE; size <= FWB_MAXSIZE; size *= 4)
+	{
+		gettime(&ts1);
+		result = fwb_copy(ubuf, size, FWB_TOTAL);
+		gettime(&ts2);
+		if (result)
+		{
+			kprintf("fwb: copy: %s\n", strerror(result));
+			break;
+		}
+		fwb_report("copy", size, FWB_TOTAL, &ts1, &ts2);
+
+		gettime(&ts1);
+		result = fwb_direct(ubuf, size, FWB_TOTAL);
+		gettime(&ts2);
+		if (result)
+		{
+			kprintf("fwb: direct: %s\n", strerror(result));
+			break;
+		}
+		fwb_report("direct", size, FWB_TOTAL, &ts1, &ts2);
+	}
+
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+// ofb: open/close benchmark
+
+/*
+ * Open the console OFB_BATCH times, then close the descriptors (odd
+ * ones first, so that the next opens have to find the lowest free
+ * descriptor among holes), until NOPENS opens have been done. With
+ * the free list of open files and the per-process descriptor bitmap,
+ * the time per open and close doesn't grow with the number of files
+ * open in the system or in the process.
+ */
+
+#define OFB_NOPENS 4096
+#define OFB_BATCH 64
+
+int openclosebench(int nargs, char **args)
+{
+	int fds[OFB_BATCH];
+	char name[8];
+	struct timespec ts1, ts2;
+	uint64_t nsecs;
+	unsigned nopens = OFB_NOPENS, done = 0, i, n;
+	int err = 0;
+
+	if (nargs > 2)
+	{
+		kprintf("Usage: ofb [nopens]\n");
+		return EINVAL;
+	}
+	if (nargs == 2)
+	{
+		nopens = atoi(args[1]);
+	}
+
+	kprintf("Opening and closing con: %u times...\n", nopens);
+	gettime(&ts1);
+	while (done < nopens && err == 0)
+	{
+		for (n = 0; n < OFB_BATCH && done < nopens; n++, done++)
+		{
+			/* vfs_open destroys the string it's passed */
+			strcpy(name, "con:");
+			fds[n] = sys_open((userptr_t)name, O_RDONLY, 0, &err);
+			if (fds[n] < 0)
+			{
+				kprintf("ofb: open: %s\n", strerror(err));
+				break;
+			}
+		}
+		for (i = 1; i < n; i += 2)
+		{
+			sys_close(fds[i]);
+		}
+		for (i = 0; i < n; i += 2)
+		{
+			sys_close(fds[i]);
+		}
+	}
+	gettime(&ts2);
+
+	timespec_sub(&ts2, &ts1, &ts2);
+	nsecs = (uint64_t)ts2.tv_sec * 1000000000 + ts2.tv_nsec;
+	kprintf("%u opens and closes in %llu.%09lu seconds (%lu ns each)\n",
+			done, (unsigned long long)ts2.tv_sec,
+			(unsigned long)ts2.tv_nsec,
+			done == 0 ? 0 : (unsigned long)(nsecs / done));
+	return err;
+}
@@ -35,6 +35,7 @@
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
 #include <vm.h> /* for PAGE_SIZE */
 #include <test.h>
 
@@ -378,3 +379,135 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * kfree with the allocation profiler on: the blocks freed must go
+ * back to the heap (not just out of the profiler's tables), so the
+ * count of live blocks printed by kh must come back down.
+ */
+
+#define KM5_NBLOCKS 64
+#define KM5_SIZE    100
+
+int
+kmalloctest5(int nargs, char **args)
+{
+	void *ptrs[KM5_NBLOCKS];
+	unsigned i, before, during, after;
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting kfree with profiler on test...\n");
+	kheap_profile_start();
+	before = kheap_nlive();
+	for (i=0; i<KM5_NBLOCKS; i++) {
+		ptrs[i] = kmalloc(KM5_SIZE);
+		if (ptrs[i] == NULL) {
+			panic("kmalloctest5: kmalloc failed\n");
+		}
+	}
+	during = kheap_nlive();
+	for (i=0; i<KM5_NBLOCKS; i++) {
+		kfree(ptrs[i]);
+	}
+	after = kheap_nlive();
+	kheap_profile_stop();
+
+	kprintf("Live blocks: %u before, %u allocated, %u freed\n",
+		before, during, after);
+	/* allow for a few allocations elsewhere meanwhile */
+	ok = after + KM5_NBLOCKS / 2 <= during;
+	kprintf("kfree with profiler on test %s\n", ok ? "done" : "failed");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// km
+
+/*
+ * kfree benchmark: grow the heap to NPAGES pages of KMB_SIZE blocks,
+ * for increasing NPAGES, and time freeing every other block. No page
+ * becomes empty, so this measures the cost of finding the block's
+ * page, which should not depend on how big the heap is.
+ */
+
+#define KMB_SIZE     128
+#define KMB_MAXPAGES 256
+#define KMB_PERPAGE  (PAGE_SIZE / KMB_SIZE)
+
+int
+kmallocbench(int nargs, char **args)
+{
+	struct timespec ts1, ts2;
+	void **ptrs;
+	unsigned maxpages = KMB_MAXPAGES;
+	unsigned npages, nblocks, nfreed, i;
+	uint64_t ns;
+
+	if (nargs > 2) {
+		kprintf("Usage: km [maxpages]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		maxpages = atoi(args[1]);
+	}
+	if (maxpages < 1 || maxpages > 1024) {
+		kprintf("km: maxpages must be between 1 and 1024\n");
+		return EINVAL;
+	}
+
+	ptrs = kmalloc(maxpages * KMB_PERPAGE * sizeof(void *));
+	if (ptrs == NULL) {
+		return ENOMEM;
+	}
+
+	kprintf("kfree latency with %u-byte blocks:\n", KMB_SIZE);
+	for (npages = 1; ; npages *= 4) {
+		if (npages > maxpages) {
+			npages = maxpages;
+		}
+		nblocks = npages * KMB_PERPAGE;
+		for (i=0; i<nblocks; i++) {
+			ptrs[i] = kmalloc(KMB_SIZE);
+			if (ptrs[i] == NULL) {
+				kprintf("km: out of memory at %u pages\n",
+					npages);
+				while (i-- > 0) {
+					kfree(ptrs[i]);
+				}
+				kfree(ptrs);
+				return ENOMEM;
+			}
+		}
+
+		gettime(&ts1);
+		nfreed = 0;
+		for (i=1; i<nblocks; i+=2) {
+			kfree(ptrs[i]);
+			nfreed++;
+		}
+		gettime(&ts2);
+		timespec_sub(&ts2, &ts1, &ts2);
+		ns = ts2.tv_sec * 1000000000ULL + ts2.tv_nsec;
+
+		kprintf("  %5u heap pages: %u frees, %llu ns each\n",
+			npages, nfreed,
+			nfreed > 0 ? (unsigned long long)(ns / nfreed) : 0ULL);
+
+		for (i=0; i<nblocks; i+=2) {
+			kfree(ptrs[i]);
+		}
+		if (npages == maxpages) {
+			break;
+		}
+	}
+
+	kfree(ptrs);
+	kprintf("km: done\n");
+	return 0;
+}
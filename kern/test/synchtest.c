@@ -220,6 +220,112 @@ locktest(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Lock contention benchmark: like sy2, threads take a lock over and
+ * over, here with a short critical section and a little work outside
+ * it, for 1, 2, 4 and 8 threads, first with locks that always sleep
+ * when held and then with adaptive ones.
+ */
+
+#if OPT_LOCKS_SEMAPHORES || OPT_LOCKS_WCHANS
+#define LKB_ACQUIRES	2000	/* per thread */
+#define LKB_INSIDE	20	/* loops in the critical section */
+#define LKB_OUTSIDE	60	/* loops between two acquires */
+#define LKB_MAXTHREADS	8
+
+static struct lock *lkblock;
+static volatile unsigned long lkbcount;
+
+static
+void
+lkbthread(void *junk, unsigned long num)
+{
+	volatile int j;
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<LKB_ACQUIRES; i++) {
+		lock_acquire(lkblock);
+		lkbcount++;
+		for (j=0; j<LKB_INSIDE; j++);
+		lock_release(lkblock);
+		for (j=0; j<LKB_OUTSIDE; j++);
+	}
+	V(donesem);
+}
+
+static
+void
+lkbrun(bool adaptive, int nthreads)
+{
+	struct timespec ts1, ts2;
+	uint64_t ns;
+	int i, result;
+
+	lock_adaptive = adaptive;
+	lkbcount = 0;
+	gettime(&ts1);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("lockbench", NULL, lkbthread, NULL, i);
+		if (result) {
+			panic("lockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(donesem);
+	}
+	gettime(&ts2);
+
+	timespec_sub(&ts2, &ts1, &ts2);
+	ns = (uint64_t)ts2.tv_sec * 1000000000 + ts2.tv_nsec;
+	if (lkbcount != (unsigned long)nthreads * LKB_ACQUIRES) {
+		kprintf("lockbench: %lu acquires, expected %lu\n",
+			lkbcount, (unsigned long)nthreads * LKB_ACQUIRES);
+	}
+	kprintf("  %-8s %d threads: %8llu acquisitions/s\n",
+		adaptive ? "adaptive" : "blocking", nthreads,
+		ns == 0 ? 0ULL :
+		(unsigned long long)lkbcount * 1000000000 / ns);
+}
+#endif
+
+int
+lockbench(int nargs, char **args)
+{
+#if OPT_LOCKS_SEMAPHORES || OPT_LOCKS_WCHANS
+	bool saved = lock_adaptive;
+	int n;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	if (lkblock == NULL) {
+		lkblock = lock_create("lockbench");
+		if (lkblock == NULL) {
+			panic("lockbench: lock_create failed\n");
+		}
+	}
+
+	kprintf("Starting lock contention benchmark...\n");
+	for (n=1; n<=LKB_MAXTHREADS; n*=2) {
+		lkbrun(false, n);
+		lkbrun(true, n);
+	}
+	lock_adaptive = saved;
+
+	kprintf("Lock contention benchmark done.\n");
+#else
+	(void)nargs;
+	(void)args;
+	kprintf("lockbench: this kernel has no locks\n");
+#endif
+	return 0;
+}
+
 static
 void
 cvtestthread(void *junk, unsigned long num)
@@ -399,3 +505,110 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// timed waits
+
+/*
+ * Sleeps of some hardclocks, measured with the clock (the longer
+ * ones go through the upper levels of the timer wheel), then a
+ * cv_wait_timeout that nobody signals, then lock_acquire_timeout on
+ * a lock held by another thread for TWHOLD ticks: too short a timeout
+ * must fail and a long enough one must succeed. A wait may not end
+ * more than one hardclock period early.
+ */
+
+#define TWHOLD 50
+
+static const unsigned twsleeps[] = { 1, 2, 5, 10, 70, 150 };
+
+static
+bool
+twcheck(const char *what, unsigned ticks,
+	struct timespec *ts1, struct timespec *ts2)
+{
+	uint64_t ns, minns;
+
+	timespec_sub(ts2, ts1, ts2);
+	ns = (uint64_t)ts2->tv_sec * 1000000000 + ts2->tv_nsec;
+	minns = (uint64_t)(ticks - 1) * (1000000000 / HZ);
+	kprintf("%s %3u ticks: %4llu ms\n", what, ticks,
+		(unsigned long long)ns / 1000000);
+	if (ns < minns) {
+		kprintf("That's too short\n");
+		return false;
+	}
+	return true;
+}
+
+static
+void
+twholder(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	lock_acquire(testlock);
+	V(donesem);
+	thread_sleep_ticks(TWHOLD);
+	lock_release(testlock);
+	V(donesem);
+}
+
+int
+timedwaittest(int nargs, char **args)
+{
+	struct timespec ts1, ts2;
+	unsigned i;
+	bool ok = true;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting timed wait test...\n");
+
+	for (i=0; i<sizeof(twsleeps)/sizeof(twsleeps[0]); i++) {
+		gettime(&ts1);
+		thread_sleep_ticks(twsleeps[i]);
+		gettime(&ts2);
+		ok = twcheck("sleep", twsleeps[i], &ts1, &ts2) && ok;
+	}
+
+	lock_acquire(testlock);
+	gettime(&ts1);
+	if (cv_wait_timeout(testcv, testlock, 10)) {
+		kprintf("cv_wait_timeout: woken up, but nobody signalled\n");
+		ok = false;
+	}
+	gettime(&ts2);
+	lock_release(testlock);
+	ok = twcheck("cv", 10, &ts1, &ts2) && ok;
+
+	result = thread_fork("timedwaittest", NULL, twholder, NULL, 0);
+	if (result) {
+		panic("timedwaittest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+	P(donesem);
+	gettime(&ts1);
+	if (lock_acquire_timeout(testlock, 5)) {
+		kprintf("lock_acquire_timeout: got a lock that's held\n");
+		lock_release(testlock);
+		ok = false;
+	}
+	gettime(&ts2);
+	ok = twcheck("lock", 5, &ts1, &ts2) && ok;
+	if (!lock_acquire_timeout(testlock, 4 * TWHOLD)) {
+		kprintf("lock_acquire_timeout: lock never released\n");
+		ok = false;
+	}
+	else {
+		lock_release(testlock);
+	}
+	P(donesem);
+
+	kprintf("Timed wait test %s\n", ok ? "done" : "failed");
+	return 0;
+}
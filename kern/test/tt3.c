@@ -32,6 +32,8 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
 #include <wchan.h>
 #include <thread.h>
 #include <synch.h>
@@ -274,3 +276,237 @@ threadtest3(int nargs, char **args)
 	}
 	return 0;
 }
+
+/*
+ * Wakeup latency benchmark.
+ *
+ * Like tt3, sleeper threads run alongside compute threads, but here a
+ * waker posts a timestamp to one sleeper at a time, every
+ * WLB_SPACING_NS, and the sleeper measures how long it took from its
+ * V() to running again. The waker polls the clock in between, so it
+ * is load too. With a round-robin run queue a woken sleeper waits
+ * behind every compute thread; with the feedback queue it runs at the
+ * next hardclock at the latest.
+ */
+
+#define WLB_ROUNDS      20		/* wakeups per sleeper */
+#define WLB_SPACING_NS  5000000		/* between two wakeups */
+#define WLB_MAXSLEEPERS 16
+
+struct wlb_sleeper {
+	struct semaphore *sem;
+	volatile bool pending;		/* posted, not run yet */
+	struct timespec posted;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	unsigned count;
+};
+
+static struct wlb_sleeper wlb_sleepers[WLB_MAXSLEEPERS];
+static unsigned wlb_nsleepers;
+
+static
+uint64_t
+wlb_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static
+void
+wlb_sleeper_thread(void *junk, unsigned long num)
+{
+	struct wlb_sleeper *s = &wlb_sleepers[num];
+	struct timespec now, lat;
+	uint64_t ns;
+	unsigned i;
+
+	(void)junk;
+
+	for (i=0; i<WLB_ROUNDS; i++) {
+		P(s->sem);
+		gettime(&now);
+		timespec_sub(&now, &s->posted, &lat);
+		ns = wlb_ns(&lat);
+		s->total_ns += ns;
+		if (ns > s->max_ns) {
+			s->max_ns = ns;
+		}
+		s->count++;
+		s->pending = false;
+	}
+	V(donesem);
+}
+
+static
+void
+wlb_waker_thread(void *junk1, unsigned long junk2)
+{
+	struct wlb_sleeper *s;
+	struct timespec last, now, diff;
+	unsigned next = 0, posted = 0;
+
+	(void)junk1;
+	(void)junk2;
+
+	gettime(&last);
+	while (posted < wlb_nsleepers * WLB_ROUNDS) {
+		gettime(&now);
+		timespec_sub(&now, &last, &diff);
+		s = &wlb_sleepers[next];
+		if (wlb_ns(&diff) < WLB_SPACING_NS || s->pending) {
+			thread_yield();
+			continue;
+		}
+		last = now;
+		s->pending = true;
+		gettime(&s->posted);
+		V(s->sem);
+		posted++;
+		next = (next + 1) % wlb_nsleepers;
+	}
+	V(donesem);
+}
+
+static
+void
+wlb_report(void)
+{
+	uint64_t total = 0, max = 0;
+	unsigned count = 0, i;
+
+	for (i=0; i<wlb_nsleepers; i++) {
+		total += wlb_sleepers[i].total_ns;
+		count += wlb_sleepers[i].count;
+		if (wlb_sleepers[i].max_ns > max) {
+			max = wlb_sleepers[i].max_ns;
+		}
+	}
+	kprintf("\n%u wakeups: average latency %llu us, max %llu us\n",
+		count, count == 0 ? 0ULL :
+		(unsigned long long)(total / count / 1000),
+		(unsigned long long)(max / 1000));
+	thread_printstats();
+}
+
+int
+wakeuplatencybench(int nargs, char **args)
+{
+	int nsleeps = 4, ncomputes = 2;
+	unsigned i;
+	int result;
+
+	if (nargs == 3) {
+		nsleeps = atoi(args[1]);
+		ncomputes = atoi(args[2]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: wlb [sleepthreads computethreads]\n");
+		return 1;
+	}
+	if (nsleeps < 1 || nsleeps > WLB_MAXSLEEPERS || ncomputes < 0) {
+		kprintf("wlb: 1 to %u sleepers\n", WLB_MAXSLEEPERS);
+		return 1;
+	}
+
+	setup();
+	wlb_nsleepers = nsleeps;
+	for (i=0; i<wlb_nsleepers; i++) {
+		if (wlb_sleepers[i].sem == NULL) {
+			wlb_sleepers[i].sem = sem_create("wlb", 0);
+			if (wlb_sleepers[i].sem == NULL) {
+				panic("wlb: sem_create failed\n");
+			}
+		}
+		wlb_sleepers[i].pending = false;
+		wlb_sleepers[i].total_ns = 0;
+		wlb_sleepers[i].max_ns = 0;
+		wlb_sleepers[i].count = 0;
+	}
+
+	kprintf("Starting wakeup latency benchmark (%d sleepers, "
+		"%d {computes})\n", nsleeps, ncomputes);
+	for (i=0; i<wlb_nsleepers; i++) {
+		result = thread_fork("wlb-sleeper", NULL, wlb_sleeper_thread,
+				     NULL, i);
+		if (result) {
+			panic("thread_fork failed: %s\n", strerror(result));
+		}
+	}
+	make_computes(ncomputes);
+	result = thread_fork("wlb-waker", NULL, wlb_waker_thread, NULL, 0);
+	if (result) {
+		panic("thread_fork failed: %s\n", strerror(result));
+	}
+
+	for (i=0; i<wlb_nsleepers + ncomputes + 1; i++) {
+		P(donesem);
+	}
+	wlb_report();
+	return 0;
+}
+
+/*
+ * Idle wakeup benchmark.
+ *
+ * Sleep for a few seconds, so that all cpus are idle, first with
+ * periodic hardclocks and then tickless, and print how many times per
+ * second each cpu came out of cpu_idle(). Cpus are sent an IPI after
+ * each switch, so that none is left waiting on a timer set in the
+ * other mode.
+ */
+
+#define IWB_SECS 5
+
+static
+void
+iwb_run(bool tickless, int secs)
+{
+	unsigned before[32];
+	unsigned i, n;
+	struct cpu *c;
+
+	n = cpu_count();
+	if (n > 32) {
+		n = 32;
+	}
+	hardclock_tickless = tickless;
+	ipi_broadcast(IPI_UNIDLE);
+	clocksleep(1);
+
+	for (i=0; i<n; i++) {
+		before[i] = cpu_get(i)->c_idle_wakeups;
+	}
+	clocksleep(secs);
+	kprintf("%s:\n", tickless ? "tickless" : "periodic");
+	for (i=0; i<n; i++) {
+		c = cpu_get(i);
+		kprintf("  cpu%u: %u wakeups/s\n", c->c_number,
+			(c->c_idle_wakeups - before[i]) / secs);
+	}
+}
+
+int
+idlewakeupbench(int nargs, char **args)
+{
+	bool saved = hardclock_tickless;
+	int secs = IWB_SECS;
+
+	if (nargs == 2) {
+		secs = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: iwb [seconds]\n");
+		return 1;
+	}
+	if (secs < 1) {
+		kprintf("iwb: at least one second\n");
+		return 1;
+	}
+
+	kprintf("Idle wakeups over %d seconds:\n", secs);
+	iwb_run(false, secs);
+	iwb_run(true, secs);
+	hardclock_tickless = saved;
+	return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * VM benchmarks.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <test.h>
+#include "opt-swap.h"
+
+////////////////////////////////////////////////////////////
+// fb: fork benchmark
+
+/*
+ * Copy an address space of NPAGES resident pages NFORKS times, the
+ * way sys_fork does, and let the child dirty one page before it is
+ * thrown away, as a fork+exec would. The parent dirties one page too.
+ *
+ * The address spaces are installed in the current (kernel) process
+ * and their pages touched from the kernel: user addresses fault in
+ * through vm_fault as they would for a user program.
+ *
+ * With copy-on-write each iteration copies one page (the child's) and
+ * gets the parent's back without copying; an eager as_copy would copy
+ * all NPAGES.
+ */
+
+#define FB_VBASE 0x400000
+#define FB_NPAGES 64
+#define FB_NFORKS 200
+
+/* Write to every page of [vbase, vbase + npages pages) */
+static void fb_touch(vaddr_t vbase, unsigned npages, char val)
+{
+	unsigned i;
+
+	for (i = 0; i < npages; i++)
+	{
+		((volatile char *)vbase)[i * PAGE_SIZE] = val;
+	}
+}
+
+int forkbench(int nargs, char **args)
+{
+	struct addrspace *as, *child, *oldas;
+	struct vm_cowstats before, after;
+	struct timespec ts1, ts2;
+	unsigned npages = FB_NPAGES, nforks = FB_NFORKS, i;
+	int result = 0;
+
+	if (nargs > 3)
+	{
+		kprintf("Usage: fb [npages [nforks]]\n");
+		return EINVAL;
+	}
+	if (nargs > 1)
+	{
+		npages = atoi(args[1]);
+	}
+	if (nargs > 2)
+	{
+		nforks = atoi(args[2]);
+	}
+	if (npages == 0 || npages > 1024)
+	{
+		kprintf("fb: npages must be between 1 and 1024\n");
+		return EINVAL;
+	}
+
+	as = as_create();
+	if (as == NULL)
+	{
+		return ENOMEM;
+	}
+	result = as_define_region(as, FB_VBASE, npages * PAGE_SIZE, 1, 1, 0);
+	if (result)
+	{
+		as_destroy(as);
+		return result;
+	}
+
+	oldas = proc_setas(as);
+	as_activate();
+	fb_touch(FB_VBASE, npages, 1);
+
+	kprintf("Forking a %u-page address space %u times...\n",
+			npages, nforks);
+	vm_getcowstats(&before);
+	gettime(&ts1);
+	for (i = 0; i < nforks; i++)
+	{
+		result = as_copy(as, &child);
+		if (result)
+		{
+			kprintf("fb: as_copy failed: %s\n", strerror(result));
+			break;
+		}
+
+		/* child */
+		proc_setas(child);
+		as_activate();
+		fb_touch(FB_VBASE, 1, 2);
+		if (((volatile char *)FB_VBASE)[(npages - 1) * PAGE_SIZE] != 1)
+		{
+			panic("fb: child does not see the parent's data\n");
+		}
+
+		/* parent */
+		proc_setas(as);
+		as_activate();
+		as_destroy(child);
+		if (((volatile char *)FB_VBASE)[0] != 1)
+		{
+			panic("fb: parent sees the child's write\n");
+		}
+		fb_touch(FB_VBASE, 1, 1);
+	}
+	gettime(&ts2);
+	vm_getcowstats(&after);
+
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+
+	timespec_sub(&ts2, &ts1, &ts2);
+	kprintf("%u forks in %llu.%09lu seconds\n", i,
+			(unsigned long long)ts2.tv_sec, (unsigned long)ts2.tv_nsec);
+	kprintf("Pages shared at fork:      %lu\n",
+			after.cs_shared - before.cs_shared);
+	kprintf("Pages copied on write:     %lu\n",
+			after.cs_copied - before.cs_copied);
+	kprintf("Pages reused without copy: %lu\n",
+			after.cs_reused - before.cs_reused);
+	kprintf("Pages an eager copy would copy: %lu\n",
+			(unsigned long)i * npages);
+	return result;
+}
+
+#if OPT_SWAP
+////////////////////////////////////////////////////////////
+// swt: swap test
+
+/*
+ * Fill an address space larger than physical memory, one word per
+ * page, then read everything back twice: most pages have to come back
+ * from swap, and every one must still hold what was written.
+ */
+
+#define SWT_VBASE 0x400000
+
+int swaptest(int nargs, char **args)
+{
+	struct addrspace *as, *oldas;
+	struct timespec ts1, ts2;
+	unsigned npages, i, pass, bad = 0;
+	volatile unsigned *word;
+	int result;
+
+	npages = ram_getsize() / PAGE_SIZE + 256;
+	if (nargs > 2)
+	{
+		kprintf("Usage: swt [npages]\n");
+		return EINVAL;
+	}
+	if (nargs == 2)
+	{
+		npages = atoi(args[1]);
+	}
+	/* stay well below the stack */
+	if (npages == 0 || npages > (USERSTACK - SWT_VBASE) / PAGE_SIZE / 2)
+	{
+		kprintf("swt: bad number of pages\n");
+		return EINVAL;
+	}
+
+	as = as_create();
+	if (as == NULL)
+	{
+		return ENOMEM;
+	}
+	result = as_define_region(as, SWT_VBASE, npages * PAGE_SIZE, 1, 1, 0);
+	if (result)
+	{
+		as_destroy(as);
+		return result;
+	}
+	oldas = proc_setas(as);
+	as_activate();
+
+	kprintf("Touching %u pages (%u KB of RAM)...\n", npages,
+			(unsigned)(ram_getsize() / 1024));
+	gettime(&ts1);
+	for (i = 0; i < npages; i++)
+	{
+		word = (volatile unsigned *)(SWT_VBASE + i * PAGE_SIZE);
+		*word = i * 2654435761U;
+	}
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (i = 0; i < npages; i++)
+		{
+			word = (volatile unsigned *)(SWT_VBASE + i * PAGE_SIZE);
+			if (*word != i * 2654435761U)
+			{
+				bad++;
+			}
+		}
+	}
+	gettime(&ts2);
+
+	proc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+
+	timespec_sub(&ts2, &ts1, &ts2);
+	kprintf("Done in %llu.%09lu seconds\n",
+			(unsigned long long)ts2.tv_sec, (unsigned long)ts2.tv_nsec);
+	write_memstats();
+	if (bad > 0)
+	{
+		kprintf("swt: %u pages lost their contents. Test failed.\n", bad);
+		return EIO;
+	}
+	kprintf("swt: passed\n");
+	return 0;
+}
+#endif /* OPT_SWAP */
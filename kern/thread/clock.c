@@ -34,13 +34,14 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * Callbacks can be scheduled for some hardclocks in the future with
+ * timeouts (see timeout.c), which also give threads sleeps of any
+ * number of ticks and timed waits.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -51,7 +52,8 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define MIGRATE_HARDCLOCKS	64	/* Migrate every 64 hardclocks. */
+#define IDLE_HARDCLOCKS		(60 * HZ) /* Longest tickless idle. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
@@ -59,6 +61,12 @@
 static struct wchan *lbolt;
 static struct spinlock lbolt_lock;
 
+/*
+ * Threads in thread_sleep_ticks. Each is woken by its own timeout.
+ */
+static struct wchan *sleep_wchan;
+static struct spinlock sleep_lock;
+
 /*
  * Setup.
  */
@@ -70,6 +78,11 @@ hardclock_bootstrap(void)
 	if (lbolt == NULL) {
 		panic("Couldn't create lbolt\n");
 	}
+	spinlock_init(&sleep_lock);
+	sleep_wchan = wchan_create("tsleep");
+	if (sleep_wchan == NULL) {
+		panic("Couldn't create tsleep\n");
+	}
 }
 
 /*
@@ -96,14 +109,66 @@ hardclock(void)
 	 * Collect statistics here as desired.
 	 */
 
+	if (curcpu->c_tickless_ticks > 0) {
+		/* The idle deadline went off; count the ticks skipped. */
+		curcpu->c_hardclocks += curcpu->c_tickless_ticks - 1;
+		curcpu->c_tickless_ticks = 0;
+	}
 	curcpu->c_hardclocks++;
+	if (curcpu->c_isidle) {
+		curcpu->c_idle_hardclocks++;
+	}
+	timerwheel_tick(&curcpu->c_timerwheel);
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	/* Quantum expiry (and demotion) or preemption. */
+	thread_tick();
+}
+
+/*
+ * Tickless idle.
+ *
+ * A cpu with nothing to run and no timeouts pending has no use for
+ * hardclock: there is no quantum to charge, and migration and
+ * priority boosts only look at threads in the run queue. So, instead
+ * of waking up HZ times a second to find that out, an idle cpu sets
+ * its timer to go off once, far in the future, and sleeps until an
+ * interrupt (a device, or an IPI from a cpu that gave it a thread or
+ * has one waiting for it to steal) wakes it up. Then it goes back to
+ * periodic ticks, which it keeps as long as it has threads to run.
+ *
+ * The ticks skipped are added to c_hardclocks, which is also used as
+ * a clock by the scheduler. (timerclock, and with it lbolt, is driven
+ * by a different timer and isn't affected.)
+ */
+bool hardclock_tickless = true;
+
+void
+hardclock_idle(void)
+{
+	KASSERT(curcpu->c_isidle);
+
+	if (!hardclock_tickless || curcpu->c_timerwheel.tw_count > 0) {
+		return;
+	}
+	curcpu->c_tickless_ticks = IDLE_HARDCLOCKS;
+	mainbus_timer_oneshot(IDLE_HARDCLOCKS);
+}
+
+void
+hardclock_unidle(void)
+{
+	curcpu->c_idle_wakeups++;
+	if (curcpu->c_tickless_ticks == 0) {
+		/* Periodic, or hardclock already ran for the deadline. */
+		return;
+	}
+	curcpu->c_hardclocks += mainbus_timer_periodic();
+	curcpu->c_tickless_ticks = 0;
 }
 
 /*
@@ -112,10 +177,27 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	if (num_secs > 0) {
+		thread_sleep_ticks(num_secs * HZ);
 	}
-	spinlock_release(&lbolt_lock);
+}
+
+/*
+ * Suspend execution for some hardclocks.
+ */
+void
+thread_sleep_ticks(unsigned ticks)
+{
+	struct wchan_timeout wt;
+
+	if (ticks == 0) {
+		return;
+	}
+	spinlock_acquire(&sleep_lock);
+	wchan_timeout_start(&wt, sleep_wchan, &sleep_lock, ticks);
+	while (!wt.wt_expired) {
+		wchan_sleep(sleep_wchan, &sleep_lock);
+	}
+	spinlock_release(&sleep_lock);
+	wchan_timeout_stop(&wt);
 }
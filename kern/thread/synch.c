@@ -33,23 +33,59 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <cpu.h>
 #include <synch.h>
+#include <kmem_cache.h>
+
+/*
+ * The primitives come from object caches, whose constructors create
+ * their wait channels (and, for locks built on semaphores, the
+ * semaphore): those are kept across uses, and only the name changes.
+ */
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+static int
+sem_ctor(void *obj)
+{
+        struct semaphore *sem = obj;
+
+        sem->sem_wchan = wchan_create("sem");
+        if (sem->sem_wchan == NULL)
+        {
+                return ENOMEM;
+        }
+        spinlock_init(&sem->sem_lock);
+        return 0;
+}
+
+static void
+sem_dtor(void *obj)
+{
+        struct semaphore *sem = obj;
+
+        spinlock_cleanup(&sem->sem_lock);
+        wchan_destroy(sem->sem_wchan);
+}
+
+static struct kmem_cache sem_cache =
+        KMEM_CACHE_INITIALIZER("semaphore", sizeof(struct semaphore), 0,
+                               sem_ctor, sem_dtor);
+
 struct semaphore *
 sem_create(const char *name, unsigned initial_count)
 {
         struct semaphore *sem;
 
-        sem = kmalloc(sizeof(*sem));
+        sem = kmem_cache_alloc(&sem_cache);
         if (sem == NULL)
         {
                 return NULL;
@@ -58,19 +94,11 @@ sem_create(const char *name, unsigned initial_count)
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL)
         {
-                kfree(sem);
+                kmem_cache_free(&sem_cache, sem);
                 return NULL;
         }
 
-        sem->sem_wchan = wchan_create(sem->sem_name);
-        if (sem->sem_wchan == NULL)
-        {
-                kfree(sem->sem_name);
-                kfree(sem);
-                return NULL;
-        }
-
-        spinlock_init(&sem->sem_lock);
+        wchan_setname(sem->sem_wchan, sem->sem_name);
         sem->sem_count = initial_count;
 
         return sem;
@@ -80,11 +108,23 @@ void sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-        /* wchan_cleanup will assert if anyone's waiting on it */
-        spinlock_cleanup(&sem->sem_lock);
-        wchan_destroy(sem->sem_wchan);
+        /* nobody may be waiting on it */
+        spinlock_acquire(&sem->sem_lock);
+        KASSERT(wchan_isempty(sem->sem_wchan, &sem->sem_lock));
+        spinlock_release(&sem->sem_lock);
+        wchan_setname(sem->sem_wchan, "sem");
         kfree(sem->sem_name);
-        kfree(sem);
+        kmem_cache_free(&sem_cache, sem);
+}
+
+void sem_reset(struct semaphore *sem, unsigned count)
+{
+        KASSERT(sem != NULL);
+
+        spinlock_acquire(&sem->sem_lock);
+        KASSERT(wchan_isempty(sem->sem_wchan, &sem->sem_lock));
+        sem->sem_count = count;
+        spinlock_release(&sem->sem_lock);
 }
 
 void P(struct semaphore *sem)
@@ -135,63 +175,167 @@ void V(struct semaphore *sem)
         spinlock_release(&sem->sem_lock);
 }
 
+bool P_timeout(struct semaphore *sem, unsigned ticks)
+{
+        struct wchan_timeout wt;
+        bool timed = false, got;
+
+        KASSERT(sem != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+        spinlock_acquire(&sem->sem_lock);
+        if (sem->sem_count == 0)
+        {
+                timed = true;
+                wchan_timeout_start(&wt, sem->sem_wchan, &sem->sem_lock,
+                                    ticks);
+                while (sem->sem_count == 0 && !wt.wt_expired)
+                {
+                        wchan_sleep(sem->sem_wchan, &sem->sem_lock);
+                }
+        }
+        /* Even if the time ran out, take it if it's there */
+        got = sem->sem_count > 0;
+        if (got)
+        {
+                sem->sem_count--;
+        }
+        spinlock_release(&sem->sem_lock);
+        if (timed)
+        {
+                wchan_timeout_stop(&wt);
+        }
+        return got;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Lock.
 
-struct lock *
-lock_create(const char *name)
+/*
+ * Adaptive locks. A thread that finds the lock held while its owner
+ * is running on another cpu will probably get it soon, so instead of
+ * going to sleep (two context switches and a trip through the run
+ * queues) it spins, watching the lock count without holding lk_spin,
+ * for up to LOCK_SPIN_MAX polls, and looks at the owner again every
+ * LOCK_SPIN_CHECK. If the owner isn't running (it's asleep, waiting
+ * for a cpu, or on this cpu) or the budget is spent, it sleeps as
+ * before. The owner is only looked at with lk_spin held, so it can't
+ * release the lock and go away meanwhile.
+ */
+#if OPT_LOCKS_SEMAPHORES || OPT_LOCKS_WCHANS
+#define LOCK_SPIN_MAX   2000
+#define LOCK_SPIN_CHECK 50
+
+bool lock_adaptive = true;
+
+/* Is the owner of LOCK running on another cpu? lk_spin held. */
+static bool lock_owner_running(struct lock *lock)
 {
-        struct lock *lock;
+        struct thread *owner = lock->owner;
 
-        lock = kmalloc(sizeof(*lock));
-        if (lock == NULL)
-        {
-                return NULL;
-        }
+        return owner != NULL && owner->t_state == S_RUN &&
+               owner->t_cpu != curcpu->c_self;
+}
 
-        lock->lk_name = kstrdup(name);
-        if (lock->lk_name == NULL)
+/*
+ * Spin while *COUNT (the lock's, or its semaphore's) is 0 and the
+ * owner is running. Called, and returns, with lk_spin held.
+ */
+static void lock_spin(struct lock *lock, volatile unsigned *count)
+{
+        unsigned spins = 0, i;
+
+        while (*count == 0 && spins < LOCK_SPIN_MAX &&
+               lock_owner_running(lock))
         {
-                kfree(lock);
-                return NULL;
+                spinlock_release(&lock->lk_spin);
+                for (i = 0; i < LOCK_SPIN_CHECK && *count == 0; i++)
+                {
+                        /* spin */
+                }
+                spins += i + 1;
+                spinlock_acquire(&lock->lk_spin);
         }
+}
+#endif
 
-        HANGMAN_LOCKABLEINIT(&lock->lk_hangman, lock->lk_name);
+static int
+lock_ctor(void *obj)
+{
+        struct lock *lock = obj;
 
-        // add stuff here as needed
 #if OPT_LOCKS_SEMAPHORES
-
-        lock->binary_semaphore = sem_create(name, 1); // Binary semaphore with initial value=1
+        lock->binary_semaphore = sem_create("lock", 1); // Binary semaphore with initial value=1
         if (lock->binary_semaphore == NULL)
         {
-                kfree(lock->lk_name);
-                kfree(lock);
-                return NULL;
+                return ENOMEM;
         }
-
         spinlock_init(&lock->lk_spin);
-
-        // N.B. it is impossible that someone already holds the lock since we haven't created it yet
-
-        lock->owner = NULL; // The owner is whoever calls lock_acquire, not who calls lock_create
+        lock->owner = NULL;
 #endif
 #if OPT_LOCKS_WCHANS
-        lock->lk_wchan = wchan_create(lock->lk_name);
+        lock->lk_wchan = wchan_create("lock");
         if (lock->lk_wchan == NULL)
         {
-                kfree(lock->lk_name);
-                kfree(lock);
-                return NULL;
+                return ENOMEM;
         }
         lock->lk_count = 1; // Like a binary semaphore with initial value=1
-
         spinlock_init(&lock->lk_spin);
+        lock->owner = NULL;
+#endif
+        (void)lock;
+        return 0;
+}
 
-        // N.B. it is impossible that someone already holds the lock since we haven't created it yet
+static void
+lock_dtor(void *obj)
+{
+        struct lock *lock = obj;
+
+#if OPT_LOCKS_SEMAPHORES
+        spinlock_cleanup(&lock->lk_spin);
+        sem_destroy(lock->binary_semaphore);
+#endif
+#if OPT_LOCKS_WCHANS
+        spinlock_cleanup(&lock->lk_spin);
+        wchan_destroy(lock->lk_wchan);
+#endif
+        (void)lock;
+}
+
+static struct kmem_cache lock_cache =
+        KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock), 0,
+                               lock_ctor, lock_dtor);
+
+struct lock *
+lock_create(const char *name)
+{
+        struct lock *lock;
+
+        lock = kmem_cache_alloc(&lock_cache);
+        if (lock == NULL)
+        {
+                return NULL;
+        }
+
+        lock->lk_name = kstrdup(name);
+        if (lock->lk_name == NULL)
+        {
+                kmem_cache_free(&lock_cache, lock);
+                return NULL;
+        }
 
-        lock->owner = NULL; // The owner is whoever calls lock_acquire, not who calls lock_create
+        HANGMAN_LOCKABLEINIT(&lock->lk_hangman, lock->lk_name);
 
+        // N.B. it is impossible that someone already holds the lock since we haven't created it yet
+        // (lock_ctor, or the last lock_destroy, left it free)
+#if OPT_LOCKS_SEMAPHORES
+        KASSERT(lock->owner == NULL && lock->binary_semaphore->sem_count == 1);
+#endif
+#if OPT_LOCKS_WCHANS
+        KASSERT(lock->owner == NULL && lock->lk_count == 1);
+        wchan_setname(lock->lk_wchan, lock->lk_name);
 #endif
 
         return lock;
@@ -201,27 +345,16 @@ void lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
 
-        // add stuff here as needed
-#if OPT_LOCKS_SEMAPHORES
-
         // when the lock is destroyed, no thread should be holding it.
+#if OPT_LOCKS_SEMAPHORES
         KASSERT(lock->owner == NULL);
-
-        spinlock_cleanup(&lock->lk_spin);
-        sem_destroy(lock->binary_semaphore);
-        kfree(lock->lk_name);
-        kfree(lock);
 #endif
 #if OPT_LOCKS_WCHANS
         KASSERT(lock->owner == NULL);
-
-        spinlock_cleanup(&lock->lk_spin);
-        wchan_destroy(lock->lk_wchan);
-        kfree(lock->lk_name);
-        kfree(lock);
-
+        wchan_setname(lock->lk_wchan, "lock");
 #endif
-        (void)lock; // suppress warning until code gets written
+        kfree(lock->lk_name);
+        kmem_cache_free(&lock_cache, lock);
 }
 
 void lock_acquire(struct lock *lock)
@@ -232,6 +365,12 @@ void lock_acquire(struct lock *lock)
         /* Call this (atomically) before waiting for a lock */
         HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
+        if (lock_adaptive)
+        {
+                spinlock_acquire(&lock->lk_spin);
+                lock_spin(lock, &lock->binary_semaphore->sem_count);
+                spinlock_release(&lock->lk_spin);
+        }
         P(lock->binary_semaphore); // Wait until semaphore=1, then enter and decrement it
         /* Call this (atomically) once the lock is acquired */
         HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
@@ -255,6 +394,10 @@ void lock_acquire(struct lock *lock)
 
         /* Use the semaphore spinlock to protect the wchan as well. */
         spinlock_acquire(&lock->lk_spin);
+        if (lock_adaptive)
+        {
+                lock_spin(lock, &lock->lk_count);
+        }
         // Wait until semaphore=1, then enter and decrement it
 
         while (lock->lk_count == 0)
@@ -284,6 +427,65 @@ void lock_acquire(struct lock *lock)
         (void)lock; // suppress warning until code gets written
 }
 
+/*
+ * A timed acquire can't deadlock, since it gives up, so it isn't shown
+ * to the deadlock detector as waiting: HANGMAN_WAIT and
+ * HANGMAN_ACQUIRE are only called once the lock is ours.
+ */
+bool lock_acquire_timeout(struct lock *lock, unsigned ticks)
+{
+#if OPT_LOCKS_SEMAPHORES
+        KASSERT(lock != NULL);
+
+        if (!P_timeout(lock->binary_semaphore, ticks))
+        {
+                return false;
+        }
+        HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+        HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+        spinlock_acquire(&lock->lk_spin);
+        lock->owner = curthread;
+        spinlock_release(&lock->lk_spin);
+        return true;
+#endif
+#if OPT_LOCKS_WCHANS
+        struct wchan_timeout wt;
+        bool timed = false, got;
+
+        KASSERT(lock != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+        spinlock_acquire(&lock->lk_spin);
+        if (lock->lk_count == 0)
+        {
+                timed = true;
+                wchan_timeout_start(&wt, lock->lk_wchan, &lock->lk_spin,
+                                    ticks);
+                while (lock->lk_count == 0 && !wt.wt_expired)
+                {
+                        wchan_sleep(lock->lk_wchan, &lock->lk_spin);
+                }
+        }
+        got = lock->lk_count == 1;
+        if (got)
+        {
+                HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+                HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+                lock->lk_count--;
+                lock->owner = curthread;
+        }
+        spinlock_release(&lock->lk_spin);
+        if (timed)
+        {
+                wchan_timeout_stop(&wt);
+        }
+        return got;
+#endif
+        (void)lock;
+        (void)ticks;
+        return false;
+}
+
 void lock_release(struct lock *lock)
 {
 #if OPT_LOCKS_SEMAPHORES
@@ -341,12 +543,44 @@ bool lock_do_i_hold(struct lock *lock)
 //
 // CV
 
+static int
+cv_ctor(void *obj)
+{
+        struct cv *cv = obj;
+
+#if OPT_CONDITION_VARIABLES
+        cv->cv_wchan = wchan_create("cv");
+        if (cv->cv_wchan == NULL)
+        {
+                return ENOMEM;
+        }
+        spinlock_init(&cv->cv_spin);
+#endif
+        (void)cv;
+        return 0;
+}
+
+static void
+cv_dtor(void *obj)
+{
+        struct cv *cv = obj;
+
+#if OPT_CONDITION_VARIABLES
+        spinlock_cleanup(&cv->cv_spin);
+        wchan_destroy(cv->cv_wchan);
+#endif
+        (void)cv;
+}
+
+static struct kmem_cache cv_cache =
+        KMEM_CACHE_INITIALIZER("cv", sizeof(struct cv), 0, cv_ctor, cv_dtor);
+
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(*cv));
+        cv = kmem_cache_alloc(&cv_cache);
         if (cv == NULL)
         {
                 return NULL;
@@ -355,21 +589,12 @@ cv_create(const char *name)
         cv->cv_name = kstrdup(name);
         if (cv->cv_name == NULL)
         {
-                kfree(cv);
+                kmem_cache_free(&cv_cache, cv);
                 return NULL;
         }
 
-// add stuff here as needed
 #if OPT_CONDITION_VARIABLES
-        cv->cv_wchan = wchan_create(cv->cv_name);
-        if (cv->cv_wchan == NULL)
-        {
-                kfree(cv->cv_name);
-                kfree(cv);
-                return NULL;
-        }
-
-        spinlock_init(&cv->cv_spin);
+        wchan_setname(cv->cv_wchan, cv->cv_name);
 #endif
         return cv;
 }
@@ -378,14 +603,14 @@ void cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
-        // add stuff here as needed
 #if OPT_CONDITION_VARIABLES
-
-        spinlock_cleanup(&cv->cv_spin);
-        wchan_destroy(cv->cv_wchan);
+        spinlock_acquire(&cv->cv_spin);
+        KASSERT(wchan_isempty(cv->cv_wchan, &cv->cv_spin));
+        spinlock_release(&cv->cv_spin);
+        wchan_setname(cv->cv_wchan, "cv");
 #endif
         kfree(cv->cv_name);
-        kfree(cv);
+        kmem_cache_free(&cv_cache, cv);
 }
 
 void cv_wait(struct cv *cv, struct lock *lock)
@@ -408,6 +633,29 @@ void cv_wait(struct cv *cv, struct lock *lock)
         (void)lock; // suppress warning until code gets written
 }
 
+bool cv_wait_timeout(struct cv *cv, struct lock *lock, unsigned ticks)
+{
+#if OPT_CONDITION_VARIABLES
+        struct wchan_timeout wt;
+
+        KASSERT(cv != NULL);
+        KASSERT(lock != NULL);
+        KASSERT(lock_do_i_hold(lock));
+        spinlock_acquire(&cv->cv_spin);
+        lock_release(lock);
+        wchan_timeout_start(&wt, cv->cv_wchan, &cv->cv_spin, ticks);
+        wchan_sleep(cv->cv_wchan, &cv->cv_spin);
+        spinlock_release(&cv->cv_spin);
+        wchan_timeout_stop(&wt);
+        lock_acquire(lock);
+        return !wt.wt_expired;
+#endif
+        (void)cv;
+        (void)lock;
+        (void)ticks;
+        return false;
+}
+
 void cv_signal(struct cv *cv, struct lock *lock)
 {
 #if OPT_CONDITION_VARIABLES
@@ -46,10 +46,12 @@
 #include <threadprivate.h>
 #include <proc.h>
 #include <current.h>
+#include <clock.h>
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmem_cache.h>
 
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
@@ -69,25 +71,47 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+static int thread_ctor(void *obj);
+static void thread_dtor(void *obj);
+static int thread_stack_ctor(void *obj);
+static int wchan_ctor(void *obj);
+static void wchan_dtor(void *obj);
+
+/* Object caches for threads, their stacks and wait channels */
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread), 0,
+						   thread_ctor, thread_dtor);
+static struct kmem_cache thread_stack_cache =
+	KMEM_CACHE_INITIALIZER("thread_stack", STACK_SIZE, 0,
+						   thread_stack_ctor, NULL);
+static struct kmem_cache wchan_cache =
+	KMEM_CACHE_INITIALIZER("wchan", sizeof(struct wchan), 0,
+						   wchan_ctor, wchan_dtor);
+
 ////////////////////////////////////////////////////////////
 
 /*
  * Stick a magic number on the bottom end of the stack. This will
  * (sometimes) catch kernel stack overflows. Use thread_checkstack()
  * to test this.
+ *
+ * This is the constructor of thread_stack_cache: a stack goes back to
+ * the cache only after thread_checkstack, so the magic number is
+ * still there when it is reused.
  */
-static void
-thread_checkstack_init(struct thread *thread)
+static int
+thread_stack_ctor(void *obj)
 {
-	((uint32_t *)thread->t_stack)[0] = THREAD_STACK_MAGIC;
-	((uint32_t *)thread->t_stack)[1] = THREAD_STACK_MAGIC;
-	((uint32_t *)thread->t_stack)[2] = THREAD_STACK_MAGIC;
-	((uint32_t *)thread->t_stack)[3] = THREAD_STACK_MAGIC;
+	((uint32_t *)obj)[0] = THREAD_STACK_MAGIC;
+	((uint32_t *)obj)[1] = THREAD_STACK_MAGIC;
+	((uint32_t *)obj)[2] = THREAD_STACK_MAGIC;
+	((uint32_t *)obj)[3] = THREAD_STACK_MAGIC;
+	return 0;
 }
 
 /*
  * Check the magic number we put on the bottom end of the stack in
- * thread_checkstack_init. If these assertions go off, it most likely
+ * thread_stack_ctor. If these assertions go off, it most likely
  * means you overflowed your stack at some point, which can cause all
  * kinds of mysterious other things to happen.
  *
@@ -107,6 +131,24 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/* Constructor and destructor of thread_cache */
+static int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_init(&thread->t_listnode, thread);
+	return 0;
+}
+
+static void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -118,7 +160,7 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(&thread_cache);
 	if (thread == NULL)
 	{
 		return NULL;
@@ -127,18 +169,21 @@ thread_create(const char *name)
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL)
 	{
-		kfree(thread);
+		kmem_cache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
+	thread->t_wchan = NULL;
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
+	/* t_listnode is set up by thread_ctor */
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
 
@@ -165,6 +210,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -180,10 +226,57 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_sched_lastboost = 0;
+	c->c_sched_demotions = 0;
+	c->c_sched_preemptions = 0;
+	c->c_sched_boosts = 0;
+	c->c_sched_steals = 0;
+	c->c_sched_migrations = 0;
+	c->c_tickless_ticks = 0;
+	c->c_idle_wakeups = 0;
+	c->c_idle_hardclocks = 0;
+#if OPT_BASIC_VM_DEALLOC
+	c->c_pagecache_count = 0;
+	c->c_pagecache_hits = 0;
+	c->c_pagecache_misses = 0;
+	c->c_pagecache_refills = 0;
+	c->c_pagecache_drains = 0;
+#endif
+	for (i = 0; i < CPU_KMAG_CLASSES; i++)
+	{
+		c->c_kmag_loaded[i] = NULL;
+		c->c_kmag_previous[i] = NULL;
+	}
+	c->c_kmag_allochits = 0;
+	c->c_kmag_allocmisses = 0;
+	c->c_kmag_freehits = 0;
+	c->c_kmag_freemisses = 0;
+	for (i = 0; i < CPU_KMALLOC_ROWS; i++)
+	{
+		c->c_kmalloc_nreq[i] = 0;
+		c->c_kmalloc_reqbytes[i] = 0;
+		c->c_kmalloc_allocbytes[i] = 0;
+	}
+#if OPT_DUMBVM
+	c->c_asid = 0;
+	c->c_asid_generation = 0;
+	c->c_tlb_flushes = 0;
+	c->c_tlb_flushes_avoided = 0;
+	c->c_tlb_faults = 0;
+	c->c_tlb_faults_free = 0;
+	c->c_tlb_faults_replace = 0;
+	c->c_tlb_faults_update = 0;
+	c->c_tlb_invalidations = 0;
+#endif
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i = 0; i < CPU_RUNQUEUE_LEVELS; i++)
+	{
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runqueue_count = 0;
 	spinlock_init(&c->c_runqueue_lock);
+	timerwheel_init(&c->c_timerwheel);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -215,12 +308,11 @@ cpu_create(unsigned hardware_number)
 	}
 	else
 	{
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		c->c_curthread->t_stack = kmem_cache_alloc(&thread_stack_cache);
 		if (c->c_curthread->t_stack == NULL)
 		{
 			panic("cpu_create: couldn't allocate stack");
 		}
-		thread_checkstack_init(c->c_curthread);
 	}
 
 	/*
@@ -260,6 +352,25 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Number of cpus created so far.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Get the cpu with software number N.
+ */
+struct cpu *
+cpu_get(unsigned n)
+{
+	KASSERT(n < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, n);
+}
+
 /*
  * Destroy a thread.
  *
@@ -283,16 +394,19 @@ thread_destroy(struct thread *thread)
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL)
 	{
-		kfree(thread->t_stack);
+		thread_checkstack(thread);
+		kmem_cache_free(&thread_stack_cache, thread->t_stack);
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
+	/* back to the state thread_ctor left it in */
+	KASSERT(thread->t_listnode.tln_prev == NULL);
+	KASSERT(thread->t_listnode.tln_next == NULL);
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -321,6 +435,8 @@ exorcise(void)
  */
 void thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -335,9 +451,15 @@ void thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i = 0; i < CPU_RUNQUEUE_LEVELS; i++)
+	{
+		struct threadlist *rq = &curcpu->c_runqueue[i];
+
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
+	curcpu->c_runqueue_count = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -446,6 +568,143 @@ void thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue of a cpu: one threadlist per priority level. Call these
+ * with the cpu's runqueue lock held.
+ */
+
+/* Queue T at the tail of its level */
+static void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < CPU_RUNQUEUE_LEVELS);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runqueue_count++;
+}
+
+/* Take the next thread to run: the head of the highest level */
+static struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i = 0; i < CPU_RUNQUEUE_LEVELS; i++)
+	{
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL)
+		{
+			c->c_runqueue_count--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* Take the thread that would run last: the tail of the lowest level */
+static struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i = CPU_RUNQUEUE_LEVELS; i-- > 0;)
+	{
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL)
+		{
+			c->c_runqueue_count--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Work stealing: called by thread_switch, without any runqueue lock
+ * held, when the current cpu has nothing to run. Take the thread
+ * that would run last on the busiest other cpu and return it, now
+ * belonging to this cpu, or NULL if every other cpu has an empty run
+ * queue. The counts are read without locks to choose the victim;
+ * they are only a hint, and the run queue is checked again under its
+ * lock.
+ */
+static struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim = NULL;
+	struct thread *t;
+	unsigned i, numcpus, count, most = 0;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i = 0; i < numcpus; i++)
+	{
+		c = cpuarray_get(&allcpus, i);
+		count = c->c_runqueue_count;
+		if (c != curcpu->c_self && count > most)
+		{
+			victim = c;
+			most = count;
+		}
+	}
+	if (victim == NULL)
+	{
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_remtail(victim);
+	if (t != NULL && t == victim->c_curthread)
+	{
+		/*
+		 * Still the victim's curthread, woken up before that
+		 * cpu got out of the idle loop (see
+		 * thread_consider_migration): it can't move.
+		 */
+		runqueue_add(victim, t);
+		t = NULL;
+	}
+	if (t != NULL)
+	{
+		t->t_cpu = curcpu->c_self;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t != NULL)
+	{
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+			  t->t_name, victim->c_number, curcpu->c_number);
+	}
+	return t;
+}
+
+/*
+ * A thread was just queued on BUSY, which has something else to do
+ * first. An idle cpu with its periodic tick stopped (see
+ * hardclock_idle) would not look for work to steal for a long time:
+ * wake one up, so that it comes and takes the thread. The idle flags
+ * and tick deadlines of the other cpus are read without their locks;
+ * at worst a cpu is woken up for nothing, or none is.
+ */
+static void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i = 0; i < numcpus; i++)
+	{
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c != curcpu->c_self && c->c_isidle &&
+			c->c_tickless_ticks > 0)
+		{
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -471,7 +730,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self)
 	{
@@ -481,6 +740,11 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (!targetcpu->c_isidle || targetcpu->c_runqueue_count > 1)
+	{
+		/* it has to wait there: maybe someone else can run it */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock)
 	{
@@ -512,14 +776,13 @@ int thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack (thread_stack_ctor puts the magic number on) */
+	newthread->t_stack = kmem_cache_alloc(&thread_stack_cache);
 	if (newthread->t_stack == NULL)
 	{
 		thread_destroy(newthread);
 		return ENOMEM;
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -598,7 +861,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue))
+	if (newstate == S_READY && curcpu->c_runqueue_count == 0)
 	{
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
@@ -615,6 +878,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		break;
 	case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
+		cur->t_wchan = wc;
 		/*
 		 * Add the thread to the list in the wait channel, and
 		 * unlock same. To avoid a race with someone else
@@ -650,16 +914,35 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
+	/*
+	 * Before idling, try to steal a thread from a busier cpu. Our
+	 * run queue lock is dropped first, so that two cpus stealing
+	 * from each other can't deadlock.
+	 */
+
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do
 	{
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu->c_self);
 		if (next == NULL)
 		{
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL)
+			{
+				hardclock_idle();
+				cpu_idle();
+				hardclock_unidle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
+			if (next != NULL)
+			{
+				curcpu->c_sched_steals++;
+				/* something may have been queued meanwhile */
+				runqueue_add(curcpu->c_self, next);
+				next = runqueue_remhead(curcpu->c_self);
+			}
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
@@ -833,16 +1116,103 @@ void thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * Each cpu has a multilevel feedback queue: CPU_RUNQUEUE_LEVELS run
+ * queues, level 0 the highest priority, and thread_switch runs the
+ * head of the highest nonempty one. New threads start at level 0.
+ *
+ * thread_tick, called on every hardclock, charges the tick to the
+ * running thread. A thread that uses up the quantum of its level
+ * (SCHED_QUANTUM hardclocks, doubling at each level) is demoted one
+ * level and goes to the back of it. Ticks used before sleeping count
+ * too, so a thread can't stay on top by sleeping just before its
+ * quantum runs out. A thread below a waiting higher level thread
+ * yields at the next tick. Threads that mostly sleep, such as the
+ * console reader, thus stay above the compute-bound ones and run at
+ * most one tick after being woken up.
+ *
+ * So that compute-bound threads don't starve, schedule(), called
+ * every few hardclocks, puts all the runnable threads of the cpu back
+ * on level 0 every SCHED_BOOST_HARDCLOCKS. Sleeping threads keep
+ * their level until they run again; being asleep they are not the
+ * ones starving.
  */
+#define SCHED_QUANTUM(level) (1U << (level))
+#define SCHED_BOOST_HARDCLOCKS HZ /* once a second */
+
+void thread_tick(void)
+{
+	struct thread *cur;
+	unsigned i;
+	bool yield = false;
+
+	cur = curthread;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	if (curcpu->c_isidle)
+	{
+		/* interrupted the idle loop; nobody to charge */
+		spinlock_release(&curcpu->c_runqueue_lock);
+		return;
+	}
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_priority))
+	{
+		if (cur->t_priority + 1 < CPU_RUNQUEUE_LEVELS)
+		{
+			cur->t_priority++;
+			curcpu->c_sched_demotions++;
+		}
+		cur->t_ticks = 0;
+		yield = true;
+	}
+	else
+	{
+		for (i = 0; i < cur->t_priority; i++)
+		{
+			if (!threadlist_isempty(&curcpu->c_runqueue[i]))
+			{
+				curcpu->c_sched_preemptions++;
+				yield = true;
+				break;
+			}
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (yield)
+	{
+		thread_yield();
+	}
+}
 
 void schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct cpu *c = curcpu->c_self;
+	struct thread *t;
+	unsigned i;
+
+	if (c->c_hardclocks - c->c_sched_lastboost < SCHED_BOOST_HARDCLOCKS)
+	{
+		return;
+	}
+	c->c_sched_lastboost = c->c_hardclocks;
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	if (!c->c_isidle)
+	{
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	for (i = 1; i < CPU_RUNQUEUE_LEVELS; i++)
+	{
+		while ((t = threadlist_remhead(&c->c_runqueue[i])) != NULL)
+		{
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(&c->c_runqueue[0], t);
+		}
+	}
+	c->c_sched_boosts++;
+	spinlock_release(&c->c_runqueue_lock);
 }
 
 /*
@@ -852,6 +1222,12 @@ void schedule(void)
  * CPU is busy and other CPUs are idle, or less busy, it should move
  * threads across to those other other CPUs.
  *
+ * Idle cpus steal work for themselves in thread_switch, so this is
+ * only a fallback for cpus that are busy but less so than others. The
+ * counts are read without taking the other cpus' run queue locks; a
+ * cpu with at most one thread waiting doesn't look at the others at
+ * all.
+ *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
  * which is fairly slow. The tradeoff between this performance loss
@@ -870,18 +1246,21 @@ void thread_consider_migration(void)
 	struct threadlist victims;
 	struct thread *t;
 
+	if (curcpu->c_runqueue_count <= 1)
+	{
+		return;
+	}
+
 	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i = 0; i < numcpus; i++)
 	{
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += c->c_runqueue_count;
 		if (c == curcpu->c_self)
 		{
-			my_count = c->c_runqueue.tl_count;
+			my_count = c->c_runqueue_count;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
@@ -895,7 +1274,8 @@ void thread_consider_migration(void)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i = 0; i < to_send; i++)
 	{
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		/* the lowest priority threads go */
+		t = runqueue_remtail(curcpu->c_self);
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -908,7 +1288,7 @@ void thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0)
+		while (c->c_runqueue_count < one_share && to_send > 0)
 		{
 			t = threadlist_remhead(&victims);
 			/*
@@ -941,10 +1321,11 @@ void thread_consider_migration(void)
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_add(c, t);
 			DEBUG(DB_THREADS,
 				  "Migrated thread %s: cpu %u -> %u",
 				  t->t_name, curcpu->c_number, c->c_number);
+			curcpu->c_sched_migrations++;
 			to_send--;
 			if (c->c_isidle)
 			{
@@ -968,7 +1349,7 @@ void thread_consider_migration(void)
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL)
 		{
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -977,6 +1358,24 @@ void thread_consider_migration(void)
 	threadlist_cleanup(&victims);
 }
 
+void thread_printstats(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	kprintf("cpu: demotions preemptions boosts   steals migrations"
+			" wakeups idleticks\n");
+	for (i = 0; i < cpuarray_num(&allcpus); i++)
+	{
+		c = cpuarray_get(&allcpus, i);
+		kprintf("%3u: %9u %11u %6u %8u %10u %7u %9u\n", c->c_number,
+				c->c_sched_demotions, c->c_sched_preemptions,
+				c->c_sched_boosts, c->c_sched_steals,
+				c->c_sched_migrations, c->c_idle_wakeups,
+				c->c_idle_hardclocks);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -991,17 +1390,34 @@ void thread_consider_migration(void)
  * arrangements should be made to free it after the wait channel is
  * destroyed.
  */
+/* Constructor and destructor of wchan_cache */
+static int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_init(&wc->wc_threads);
+	return 0;
+}
+
+static void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_cleanup(&wc->wc_threads);
+}
+
 struct wchan *
 wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(&wchan_cache);
 	if (wc == NULL)
 	{
 		return NULL;
 	}
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 
 	return wc;
@@ -1013,8 +1429,14 @@ wchan_create(const char *name)
  */
 void wchan_destroy(struct wchan *wc)
 {
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	wc->wc_name = "DESTROYED";
+	kmem_cache_free(&wchan_cache, wc);
+}
+
+void wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
 }
 
 /*
@@ -1056,6 +1478,7 @@ void wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 		/* Nobody was sleeping. */
 		return;
 	}
+	target->t_wchan = NULL;
 
 	/*
 	 * Note that thread_make_runnable acquires a runqueue lock
@@ -1086,6 +1509,7 @@ void wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 */
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL)
 	{
+		target->t_wchan = NULL;
 		threadlist_addtail(&list, target);
 	}
 
@@ -1102,6 +1526,50 @@ void wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Timed waits. When the timeout goes off it sets wt_expired and, if
+ * the thread is still asleep on the channel, takes it off the list
+ * and makes it runnable, like wchan_wakeone. Whether the thread is
+ * on the list is told by t_wchan, which is only changed with the
+ * channel's spinlock held. The flag is set even if the thread is
+ * awake, so that a caller going around a loop sees it before sleeping
+ * again.
+ */
+static void wchan_timeout_expire(void *arg)
+{
+	struct wchan_timeout *wt = arg;
+	struct thread *t = wt->wt_thread;
+
+	spinlock_acquire(wt->wt_lock);
+	wt->wt_expired = true;
+	if (t->t_wchan == wt->wt_wchan)
+	{
+		threadlist_remove(&wt->wt_wchan->wc_threads, t);
+		t->t_wchan = NULL;
+		thread_make_runnable(t, false);
+	}
+	spinlock_release(wt->wt_lock);
+}
+
+void wchan_timeout_start(struct wchan_timeout *wt, struct wchan *wc,
+						 struct spinlock *lk, unsigned ticks)
+{
+	KASSERT(spinlock_do_i_hold(lk));
+
+	wt->wt_thread = curthread;
+	wt->wt_wchan = wc;
+	wt->wt_lock = lk;
+	wt->wt_expired = false;
+	timeout_init(&wt->wt_timeout, wchan_timeout_expire, wt);
+	timeout_add(&wt->wt_timeout, ticks);
+}
+
+void wchan_timeout_stop(struct wchan_timeout *wt)
+{
+	KASSERT(!spinlock_do_i_hold(wt->wt_lock));
+	timeout_cancel(&wt->wt_timeout);
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
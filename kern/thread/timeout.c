@@ -0,0 +1,223 @@
+/*
+ * Timeouts (see timeout.h).
+ *
+ * A timeout that expires at tick E, seen from tick tw_now, goes to the
+ * lowest level whose span covers E - tw_now, in the slot E falls in at
+ * that level:
+ *
+ *   level 0: E - tw_now < 64        slot E & 63
+ *   level 1: E - tw_now < 64^2      slot (E >> 6) & 63
+ *   level 2: E - tw_now < 64^3      slot (E >> 12) & 63
+ *   level 3: E - tw_now < 64^4      slot (E >> 18) & 63
+ *
+ * When tw_now is a multiple of 64, the slot of level 1 it is now in
+ * holds exactly the timeouts expiring in the next 64 ticks, so they
+ * are moved down to level 0; likewise for the higher levels, highest
+ * first, when tw_now is a multiple of their span. A level 3 slot
+ * comes around every 64^4 ticks, which is why that is as far as a
+ * timeout can go. Ticks are unsigned and wrap around; since 64^4
+ * divides 2^32 the slots do too.
+ *
+ * The wheel is protected by tw_lock. A timeout is unlinked and marked
+ * not pending before its function is called, without the lock, so the
+ * function can add it (or others) again.
+ */
+#include <types.h>
+#include <lib.h>
+#include <membar.h>
+#include <cpu.h>
+#include <current.h>
+#include <spl.h>
+#include <timeout.h>
+
+#define TW_MASK (TW_SLOTS - 1)
+
+void timerwheel_init(struct timerwheel *tw)
+{
+	unsigned i, j;
+
+	spinlock_init(&tw->tw_lock);
+	tw->tw_now = 0;
+	tw->tw_count = 0;
+	tw->tw_fired = 0;
+	for (i = 0; i < TW_LEVELS; i++)
+	{
+		for (j = 0; j < TW_SLOTS; j++)
+		{
+			tw->tw_slots[i][j] = NULL;
+		}
+	}
+}
+
+/* Put TO in its slot for the current tw_now. Wheel locked. */
+static void timerwheel_insert(struct timerwheel *tw, struct timeout *to)
+{
+	struct timeout **slot;
+	unsigned delta, level;
+
+	delta = to->to_expires - tw->tw_now;
+	for (level = 0; level < TW_LEVELS - 1; level++)
+	{
+		if (delta < 1U << ((level + 1) * TW_BITS))
+		{
+			break;
+		}
+	}
+	slot = &tw->tw_slots[level][(to->to_expires >> (level * TW_BITS)) &
+								TW_MASK];
+
+	to->to_next = *slot;
+	if (to->to_next != NULL)
+	{
+		to->to_next->to_pprev = &to->to_next;
+	}
+	to->to_pprev = slot;
+	*slot = to;
+}
+
+/* Take TO off its slot. Wheel locked. */
+static void timerwheel_unlink(struct timeout *to)
+{
+	*to->to_pprev = to->to_next;
+	if (to->to_next != NULL)
+	{
+		to->to_next->to_pprev = to->to_pprev;
+	}
+	to->to_next = NULL;
+	to->to_pprev = NULL;
+}
+
+/* Move the current slot of LEVEL down the wheel. Wheel locked. */
+static void timerwheel_cascade(struct timerwheel *tw, unsigned level)
+{
+	struct timeout *list, *to;
+
+	list = tw->tw_slots[level][(tw->tw_now >> (level * TW_BITS)) & TW_MASK];
+	tw->tw_slots[level][(tw->tw_now >> (level * TW_BITS)) & TW_MASK] = NULL;
+	while (list != NULL)
+	{
+		to = list;
+		list = to->to_next;
+		timerwheel_insert(tw, to);
+	}
+}
+
+/*
+ * Run the timeouts of the current tick, after cascading the higher
+ * levels if it starts a new slot there. Called from hardclock.
+ */
+void timerwheel_tick(struct timerwheel *tw)
+{
+	struct timeout **slot, *to;
+	unsigned now, top, level;
+
+	spinlock_acquire(&tw->tw_lock);
+	if (tw->tw_count == 0)
+	{
+		/* Nothing to cascade or run */
+		tw->tw_now++;
+		spinlock_release(&tw->tw_lock);
+		return;
+	}
+
+	if ((tw->tw_now & TW_MASK) == 0)
+	{
+		top = 1;
+		while (top < TW_LEVELS - 1 &&
+			   ((tw->tw_now >> (top * TW_BITS)) & TW_MASK) == 0)
+		{
+			top++;
+		}
+		for (level = top; level > 0; level--)
+		{
+			timerwheel_cascade(tw, level);
+		}
+	}
+
+	/*
+	 * Move on before running anything, so that a timeout added again
+	 * by its function goes in a later slot.
+	 */
+	now = tw->tw_now++;
+	slot = &tw->tw_slots[0][now & TW_MASK];
+	while ((to = *slot) != NULL)
+	{
+		KASSERT(to->to_expires == now);
+		timerwheel_unlink(to);
+		tw->tw_count--;
+		tw->tw_fired++;
+		to->to_running = true;
+		to->to_wheel = NULL;
+		spinlock_release(&tw->tw_lock);
+
+		to->to_func(to->to_arg);
+		membar_any_any();
+		to->to_running = false;
+
+		spinlock_acquire(&tw->tw_lock);
+	}
+	spinlock_release(&tw->tw_lock);
+}
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *arg)
+{
+	to->to_next = NULL;
+	to->to_pprev = NULL;
+	to->to_expires = 0;
+	to->to_func = func;
+	to->to_arg = arg;
+	to->to_wheel = NULL;
+	to->to_running = false;
+}
+
+void timeout_add(struct timeout *to, unsigned ticks)
+{
+	struct timerwheel *tw;
+	int spl;
+
+	KASSERT(to->to_wheel == NULL);
+
+	if (ticks > TIMEOUT_MAXTICKS)
+	{
+		ticks = TIMEOUT_MAXTICKS;
+	}
+
+	/* Interrupts off, so we can't move to another cpu meanwhile */
+	spl = splhigh();
+	tw = &curcpu->c_timerwheel;
+	spinlock_acquire(&tw->tw_lock);
+	/* tw_now is the next tick to run; "now" is the one before */
+	to->to_expires = tw->tw_now + (ticks == 0 ? 0 : ticks - 1);
+	timerwheel_insert(tw, to);
+	to->to_wheel = tw;
+	tw->tw_count++;
+	spinlock_release(&tw->tw_lock);
+	splx(spl);
+}
+
+bool timeout_cancel(struct timeout *to)
+{
+	struct timerwheel *tw;
+
+	while ((tw = to->to_wheel) != NULL)
+	{
+		spinlock_acquire(&tw->tw_lock);
+		if (to->to_wheel == tw)
+		{
+			timerwheel_unlink(to);
+			tw->tw_count--;
+			to->to_wheel = NULL;
+			spinlock_release(&tw->tw_lock);
+			return true;
+		}
+		/* it went off meanwhile */
+		spinlock_release(&tw->tw_lock);
+	}
+
+	while (to->to_running)
+	{
+		/* running on another cpu; it doesn't take long */
+	}
+	membar_any_any();
+	return false;
+}
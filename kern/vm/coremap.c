@@ -0,0 +1,508 @@
+/*
+ * Coremap (see coremap.h).
+ *
+ * The array is allocated by vm_bootstrap before the buddy allocator
+ * takes over, so it comes from ram_stealmem and is never freed. Each
+ * entry takes three words:
+ *
+ *   cm_owner   owning address space (user frames, NULL if shared)
+ *   cm_vaddr   page-aligned virtual address (user frames), with the
+ *              state, the pin bit, the reference bit and the file
+ *              page bit in the low, page-offset bits
+ *   cm_refcount, and cm_wired: how many system calls are doing I/O
+ *              straight to the page (see vm_wire)
+ *
+ * so the entry for a paddr is found with a single index and the whole
+ * coremap costs 12 bytes per 4K frame (0.3% of RAM).
+ *
+ * Who allocates a frame owns it until it frees it, so the allocator
+ * switches frames between free and kernel without locking. User frames
+ * are shared by several cpus (copy-on-write, destruction of address
+ * spaces sharing frames, the clock hand), so everything about them is
+ * changed under coremap_lock. coremap_printstats takes an unlocked
+ * snapshot.
+ *
+ * The file page index is a hash table of filepage nodes, protected by
+ * coremap_lock as well, so that looking a page up and taking a
+ * reference to it is atomic with dropping the last reference and
+ * removing it. Each node is chained both by key, for lookups, and by
+ * frame, to find it again when the frame goes away.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+
+#define CM_STATE_MASK 0x003
+#define CM_PINNED 0x004
+#define CM_REFERENCED 0x008
+#define CM_FILE 0x010 /* in the file page index */
+
+struct coremap_entry
+{
+	struct addrspace *cm_owner;
+	vaddr_t cm_vaddr;
+	uint16_t cm_refcount;
+	uint16_t cm_wired;
+};
+
+#define CM_STATE(cme) ((cme)->cm_vaddr & CM_STATE_MASK)
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+static struct coremap_entry *coremap = NULL;
+static unsigned long coremapFrames = 0;
+static unsigned long clockHand = 0; /* protected by coremap_lock */
+
+struct filepage
+{
+	struct coremap_filekey fp_key;
+	unsigned long fp_frame;
+	struct filepage *fp_next;  /* same key bucket */
+	struct filepage *fp_fnext; /* same frame bucket */
+};
+
+#define FILEPAGE_BUCKETS 64
+
+/* Protected by coremap_lock */
+static struct filepage *filepageByKey[FILEPAGE_BUCKETS];
+static struct filepage *filepageByFrame[FILEPAGE_BUCKETS];
+static unsigned long filepageCount = 0;
+static unsigned long filepageHits = 0;
+static unsigned long filepageMisses = 0;
+
+void coremap_bootstrap(unsigned long nframes)
+{
+	unsigned long i;
+
+	coremap = kmalloc(nframes * sizeof(struct coremap_entry));
+	if (coremap == NULL)
+	{
+		panic("coremap_bootstrap: cannot allocate %lu entries\n", nframes);
+	}
+	bzero(coremap, nframes * sizeof(struct coremap_entry));
+	coremapFrames = nframes;
+	for (i = 0; i < nframes; i++)
+	{
+		coremap[i].cm_vaddr = CM_FIXED;
+	}
+}
+
+static struct coremap_entry *coremap_entry(paddr_t paddr)
+{
+	KASSERT(coremap != NULL);
+	KASSERT(paddr / PAGE_SIZE < coremapFrames);
+	return &coremap[paddr / PAGE_SIZE];
+}
+
+static unsigned filepage_hash(const struct coremap_filekey *key)
+{
+	return ((uintptr_t)key->fk_vnode / sizeof(void *) +
+			(unsigned)(key->fk_offset / PAGE_SIZE)) %
+		   FILEPAGE_BUCKETS;
+}
+
+static bool filepage_match(const struct coremap_filekey *a,
+						   const struct coremap_filekey *b)
+{
+	return a->fk_vnode == b->fk_vnode && a->fk_offset == b->fk_offset &&
+		   a->fk_start == b->fk_start && a->fk_end == b->fk_end;
+}
+
+/* Find the frame holding KEY (coremap_lock held) */
+static struct filepage *filepage_find(const struct coremap_filekey *key)
+{
+	struct filepage *fp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	for (fp = filepageByKey[filepage_hash(key)]; fp != NULL; fp = fp->fp_next)
+	{
+		if (filepage_match(&fp->fp_key, key))
+			return fp;
+	}
+	return NULL;
+}
+
+/* Unlink the node of FRAME, returning it to be freed (coremap_lock held) */
+static struct filepage *filepage_remove(unsigned long frame)
+{
+	struct filepage **pp, *fp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	for (pp = &filepageByFrame[frame % FILEPAGE_BUCKETS]; *pp != NULL;
+		 pp = &(*pp)->fp_fnext)
+	{
+		if ((*pp)->fp_frame == frame)
+			break;
+	}
+	fp = *pp;
+	KASSERT(fp != NULL);
+	*pp = fp->fp_fnext;
+
+	for (pp = &filepageByKey[filepage_hash(&fp->fp_key)]; *pp != fp;
+		 pp = &(*pp)->fp_next)
+	{
+		KASSERT(*pp != NULL);
+	}
+	*pp = fp->fp_next;
+	filepageCount--;
+	return fp;
+}
+
+void coremap_setstate(paddr_t paddr, unsigned long npages, unsigned state)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+	unsigned long i;
+
+	KASSERT(state == CM_FREE || state == CM_KERNEL);
+	KASSERT(paddr / PAGE_SIZE + npages <= coremapFrames);
+	for (i = 0; i < npages; i++)
+	{
+		KASSERT(CM_STATE(&cme[i]) != CM_USER);
+		KASSERT(cme[i].cm_refcount == 0);
+		KASSERT((cme[i].cm_vaddr & CM_PINNED) == 0);
+		KASSERT(cme[i].cm_wired == 0);
+		cme[i].cm_owner = NULL;
+		cme[i].cm_vaddr = state;
+	}
+}
+
+void coremap_setuser(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(CM_STATE(cme) == CM_KERNEL);
+	KASSERT(cme->cm_refcount == 0);
+	cme->cm_owner = as;
+	cme->cm_vaddr = (vaddr & PAGE_FRAME) | CM_REFERENCED | CM_USER;
+	cme->cm_refcount = 1;
+	spinlock_release(&coremap_lock);
+}
+
+void coremap_setowner(paddr_t paddr, struct addrspace *as)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+	struct filepage *fp = NULL;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(CM_STATE(cme) == CM_USER);
+	KASSERT(cme->cm_refcount == 1);
+	cme->cm_owner = as;
+	if (cme->cm_vaddr & CM_FILE)
+	{
+		/* its contents are going to change */
+		fp = filepage_remove(paddr / PAGE_SIZE);
+		cme->cm_vaddr &= ~CM_FILE;
+	}
+	spinlock_release(&coremap_lock);
+	if (fp != NULL)
+	{
+		kfree(fp);
+	}
+}
+
+bool coremap_adopt(paddr_t paddr, struct addrspace *as)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+	bool adopted;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(CM_STATE(cme) == CM_USER);
+	adopted = cme->cm_refcount == 1;
+	if (adopted)
+	{
+		cme->cm_owner = as;
+	}
+	spinlock_release(&coremap_lock);
+	return adopted;
+}
+
+void coremap_incref(paddr_t paddr)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(CM_STATE(cme) == CM_USER);
+	KASSERT(cme->cm_refcount < 0xffff);
+	cme->cm_refcount++;
+	/* shared: no single address space owns it any more */
+	cme->cm_owner = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned coremap_decref(paddr_t paddr)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+	struct filepage *fp = NULL;
+	unsigned refcount;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(CM_STATE(cme) == CM_USER);
+	KASSERT(cme->cm_refcount > 0);
+	refcount = --cme->cm_refcount;
+	if (refcount == 0)
+	{
+		/* about to be freed: the allocator makes it CM_FREE */
+		KASSERT((cme->cm_vaddr & CM_PINNED) == 0);
+		KASSERT(cme->cm_wired == 0);
+		if (cme->cm_vaddr & CM_FILE)
+		{
+			fp = filepage_remove(paddr / PAGE_SIZE);
+		}
+		cme->cm_owner = NULL;
+		cme->cm_vaddr = CM_KERNEL;
+	}
+	spinlock_release(&coremap_lock);
+	if (fp != NULL)
+	{
+		kfree(fp);
+	}
+	return refcount;
+}
+
+unsigned coremap_refcount(paddr_t paddr)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+	unsigned refcount;
+
+	spinlock_acquire(&coremap_lock);
+	refcount = cme->cm_refcount;
+	spinlock_release(&coremap_lock);
+	return refcount;
+}
+
+void coremap_pin(paddr_t paddr)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT((cme->cm_vaddr & CM_PINNED) == 0);
+	cme->cm_vaddr |= CM_PINNED;
+	spinlock_release(&coremap_lock);
+}
+
+void coremap_unpin(paddr_t paddr)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cm_vaddr & CM_PINNED);
+	cme->cm_vaddr &= ~CM_PINNED;
+	spinlock_release(&coremap_lock);
+}
+
+bool coremap_pinned(paddr_t paddr)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+	bool pinned;
+
+	spinlock_acquire(&coremap_lock);
+	pinned = (cme->cm_vaddr & CM_PINNED) != 0;
+	spinlock_release(&coremap_lock);
+	return pinned;
+}
+
+void coremap_wire(paddr_t paddr)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(CM_STATE(cme) == CM_USER);
+	KASSERT(cme->cm_wired < 0xffff);
+	cme->cm_wired++;
+	spinlock_release(&coremap_lock);
+}
+
+void coremap_unwire(paddr_t paddr)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(CM_STATE(cme) == CM_USER);
+	KASSERT(cme->cm_wired > 0);
+	cme->cm_wired--;
+	spinlock_release(&coremap_lock);
+}
+
+paddr_t coremap_file_lookup(const struct coremap_filekey *key)
+{
+	struct filepage *fp;
+	struct coremap_entry *cme;
+	paddr_t paddr = 0;
+
+	spinlock_acquire(&coremap_lock);
+	fp = filepage_find(key);
+	if (fp != NULL)
+	{
+		cme = &coremap[fp->fp_frame];
+		KASSERT(cme->cm_refcount > 0 && cme->cm_refcount < 0xffff);
+		cme->cm_refcount++;
+		cme->cm_owner = NULL;
+		cme->cm_vaddr |= CM_REFERENCED;
+		paddr = (paddr_t)fp->fp_frame * PAGE_SIZE;
+		filepageHits++;
+	}
+	else
+	{
+		filepageMisses++;
+	}
+	spinlock_release(&coremap_lock);
+	return paddr;
+}
+
+unsigned coremap_file_unhash(paddr_t paddr)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+	struct filepage *fp = NULL;
+	unsigned refcount = 0;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(CM_STATE(cme) == CM_USER);
+	if (cme->cm_vaddr & CM_FILE)
+	{
+		fp = filepage_remove(paddr / PAGE_SIZE);
+		cme->cm_vaddr &= ~CM_FILE;
+		refcount = cme->cm_refcount;
+	}
+	spinlock_release(&coremap_lock);
+	if (fp != NULL)
+	{
+		kfree(fp);
+	}
+	return refcount;
+}
+
+paddr_t coremap_file_insert(paddr_t paddr, const struct coremap_filekey *key,
+							struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+	struct filepage *fp, *newfp;
+	unsigned h;
+
+	/* can't allocate under the spinlock */
+	newfp = kmalloc(sizeof(struct filepage));
+
+	spinlock_acquire(&coremap_lock);
+	fp = filepage_find(key);
+	if (fp != NULL)
+	{
+		/* another process read the same page meanwhile */
+		cme = &coremap[fp->fp_frame];
+		KASSERT(cme->cm_refcount > 0 && cme->cm_refcount < 0xffff);
+		cme->cm_refcount++;
+		cme->cm_owner = NULL;
+		spinlock_release(&coremap_lock);
+		if (newfp != NULL)
+		{
+			kfree(newfp);
+		}
+		return (paddr_t)fp->fp_frame * PAGE_SIZE;
+	}
+
+	KASSERT(CM_STATE(cme) == CM_KERNEL);
+	KASSERT(cme->cm_refcount == 0);
+	cme->cm_owner = as;
+	cme->cm_vaddr = (vaddr & PAGE_FRAME) | CM_REFERENCED | CM_USER;
+	cme->cm_refcount = 1;
+	if (newfp != NULL)
+	{
+		/* (otherwise it just stays private) */
+		newfp->fp_key = *key;
+		newfp->fp_frame = paddr / PAGE_SIZE;
+		h = filepage_hash(key);
+		newfp->fp_next = filepageByKey[h];
+		filepageByKey[h] = newfp;
+		h = newfp->fp_frame % FILEPAGE_BUCKETS;
+		newfp->fp_fnext = filepageByFrame[h];
+		filepageByFrame[h] = newfp;
+		filepageCount++;
+		cme->cm_vaddr |= CM_FILE;
+	}
+	spinlock_release(&coremap_lock);
+	return paddr;
+}
+
+void coremap_touch(paddr_t paddr)
+{
+	struct coremap_entry *cme = coremap_entry(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(CM_STATE(cme) == CM_USER);
+	cme->cm_vaddr |= CM_REFERENCED;
+	spinlock_release(&coremap_lock);
+}
+
+bool coremap_victim(paddr_t *paddr, struct addrspace **as, vaddr_t *vaddr)
+{
+	struct coremap_entry *cme;
+	unsigned long n;
+
+	spinlock_acquire(&coremap_lock);
+	/* two turns: the first one may only clear reference bits */
+	for (n = 0; n < 2 * coremapFrames; n++)
+	{
+		cme = &coremap[clockHand];
+		clockHand = (clockHand + 1) % coremapFrames;
+		if (CM_STATE(cme) != CM_USER || (cme->cm_vaddr & CM_PINNED) ||
+			cme->cm_wired > 0 || cme->cm_refcount != 1)
+		{
+			continue;
+		}
+		if (cme->cm_vaddr & CM_REFERENCED)
+		{
+			cme->cm_vaddr &= ~CM_REFERENCED;
+			continue;
+		}
+		cme->cm_vaddr |= CM_PINNED;
+		*paddr = (paddr_t)(cme - coremap) * PAGE_SIZE;
+		*as = cme->cm_owner;
+		*vaddr = cme->cm_vaddr & PAGE_FRAME;
+		spinlock_release(&coremap_lock);
+		return true;
+	}
+	spinlock_release(&coremap_lock);
+	return false;
+}
+
+void coremap_printstats(void)
+{
+	static const char *const names[] = {"free", "fixed", "kernel", "user"};
+	unsigned long count[CM_STATE_MASK + 1];
+	unsigned long shared = 0, pinned = 0, wired = 0, orphans = 0;
+	unsigned long i;
+	struct coremap_entry *cme;
+
+	if (coremap == NULL)
+	{
+		return;
+	}
+	bzero(count, sizeof(count));
+	for (i = 0; i < coremapFrames; i++)
+	{
+		cme = &coremap[i];
+		count[CM_STATE(cme)]++;
+		if (cme->cm_vaddr & CM_PINNED)
+			pinned++;
+		if (cme->cm_wired > 0)
+			wired++;
+		if (CM_STATE(cme) == CM_USER)
+		{
+			if (cme->cm_refcount > 1)
+				shared++;
+			else if (cme->cm_owner == NULL)
+				orphans++;
+		}
+	}
+	kprintf("Coremap (%lu frames):", coremapFrames);
+	for (i = 0; i <= CM_STATE_MASK; i++)
+	{
+		kprintf(" %lu %s", count[i], names[i]);
+	}
+	kprintf("\n");
+	kprintf("User frames: %lu shared, %lu unowned, %lu pinned, "
+			"%lu wired frames\n", shared, orphans, pinned, wired);
+	kprintf("File pages: %lu indexed, %lu hits, %lu misses\n",
+			filepageCount, filepageHits, filepageMisses);
+}
@@ -29,7 +29,10 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
 
 /*
@@ -64,6 +67,11 @@ fill_deadbeef(void *vptr, size_t len)
 //    freecount, so we know when the page is completely free and can
 //    release it.
 //
+//    (For the sizes that don't divide a page evenly, a "page" is a run
+//    of slabpages[] physically contiguous pages, managed as a unit, so
+//    that little of it is left over: three pages hold exactly four
+//    3072-byte blocks, where one page would hold a single one.)
+//
 //    No assumptions are made about the sizes k; they need not be
 //    powers of two. Note, however, that malloc must always return
 //    pointers aligned to the maximum alignment requirements of the
@@ -78,6 +86,10 @@ fill_deadbeef(void *vptr, size_t len)
 //    cannot recursively use the subpage allocator. (We could probably
 //    make that work, but it would be painful.)
 //
+//    To free a block we have to find the page it's on; for that, the
+//    pagerefs are also indexed by physical page number, so kfree
+//    doesn't depend on how many heap pages there are.
+//
 
 ////////////////////////////////////////
 
@@ -100,7 +112,9 @@ fill_deadbeef(void *vptr, size_t len)
  * malloc-related bugs to manifest differently.
  *
  * LABELS records the allocation site and a generation number for each
- * allocation and is useful for tracking down memory leaks.
+ * allocation and is useful for tracking down memory leaks. (For a
+ * summary by allocation site there's also the profiler below, which
+ * is always compiled in and is turned on and off from the menu.)
  *
  * On top of these one can enable the following:
  *
@@ -111,6 +125,13 @@ fill_deadbeef(void *vptr, size_t len)
  * CHECKGUARDS checks that allocated blocks' guard bands are intact
  * when checking kernel heap pages with SLOW and SLOWER. This is also
  * quite slow in its own right.
+ *
+ * Without GUARDS and LABELS, small blocks are freed into per-cpu
+ * magazines instead of their page's free list, so the free-list checks
+ * for freeing a block twice mostly don't see them: kfree then only
+ * catches a block freed twice in a row on the same cpu (SLOW: while
+ * it is still in that cpu's magazines). A block freed twice otherwise
+ * is handed out twice. Debug double frees with GUARDS or LABELS.
  */
 
 #undef  SLOW
@@ -121,15 +142,35 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+/* Per-cpu magazines (see below), unless debugging */
+#if !defined(GUARDS) && !defined(LABELS)
+#define MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+/*
+ * The size classes, and the pages per slab for each. Tunable: the
+ * sizes must be increasing multiples of 8, and a slab must not hold
+ * more blocks than one page of the smallest size. The classes halfway
+ * between the powers of two keep the internal fragmentation of a
+ * block under a third instead of a half; kh reports how much of it
+ * there actually is for each class.
+ */
+#define NSIZES 16
+static const size_t sizes[NSIZES] = {
+	16, 24, 32, 48, 64, 96, 128, 192,
+	256, 384, 512, 768, 1024, 1536, 2048, 3072
+};
+static const unsigned slabpages[NSIZES] = {
+	1, 1, 1, 1, 1, 1, 1, 1,
+	1, 3, 1, 3, 1, 3, 1, 3
+};
 
 #define SMALLEST_SUBPAGE_SIZE 16
-#define LARGEST_SUBPAGE_SIZE 2048
+#define LARGEST_SUBPAGE_SIZE 3072
 
 #elif PAGE_SIZE == 8192
 #error "No support for 8k pages (yet?)"
@@ -137,6 +178,10 @@ static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 #error "Odd page size"
 #endif
 
+#if NSIZES + 1 > CPU_KMALLOC_ROWS
+#error "CPU_KMALLOC_ROWS is too small for the size classes"
+#endif
+
 ////////////////////////////////////////
 
 struct freelist {
@@ -145,7 +190,7 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
-	struct pageref *next_all;
+	struct pageref *prev_samesize;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -157,13 +202,15 @@ struct pageref {
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
 
+/* Bytes and blocks in a slab of block type BLK */
+#define SLAB_SIZE(blk)    (slabpages[blk] * PAGE_SIZE)
+#define SLAB_NBLOCKS(blk) (SLAB_SIZE(blk) / sizes[blk])
+
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole thing. The common case doesn't get
+ * this far anyway: it is served by the per-cpu magazines below.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -339,11 +386,52 @@ freepageref(struct pageref *p)
 ////////////////////////////////////////
 
 /*
- * Each pageref is on two linked lists: one list of pages of blocks of
- * that same size, and one of all blocks.
+ * Each pageref is on a (doubly) linked list of pages of blocks of
+ * that same size, and in the pagerefs_byframe table, under the
+ * physical page number of each of its pages.
  */
 static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+
+/* Like NUM_PAGEREFPAGES, sized for the 16M of System/161 */
+#define MAX_HEAP_FRAMES (16 * 1024 * 1024 / PAGE_SIZE)
+
+static struct pageref *pagerefs_byframe[MAX_HEAP_FRAMES];
+
+/*
+ * Return the pagerefs_byframe slot for the page containing ADDR, or
+ * NULL if ADDR is not in memory that could be on a heap page.
+ */
+static
+struct pageref **
+pageref_slot(vaddr_t addr)
+{
+	paddr_t frame;
+
+	/* (addresses below the direct-mapped segment wrap around) */
+	frame = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+	if (frame >= MAX_HEAP_FRAMES) {
+		return NULL;
+	}
+	return &pagerefs_byframe[frame];
+}
+
+/*
+ * Return the pageref whose (first) page is frame FRAME, or NULL, for
+ * going through all of them in the table.
+ */
+static
+struct pageref *
+pageref_byframe(unsigned frame)
+{
+	struct pageref *pr;
+
+	pr = pagerefs_byframe[frame];
+	if (pr == NULL ||
+	    KVADDR_TO_PADDR(PR_PAGEADDR(pr)) / PAGE_SIZE != frame) {
+		return NULL;
+	}
+	return pr;
+}
 
 ////////////////////////////////////////
 
@@ -531,7 +619,7 @@ checksubpage(struct pageref *pr)
 	KASSERT(prpage < MIPS_KSEG1);
 #endif
 
-	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	KASSERT(pr->freelist_offset < SLAB_SIZE(blktype));
 	KASSERT(pr->freelist_offset % blocksize == 0);
 
 	fla = prpage + pr->freelist_offset;
@@ -539,7 +627,7 @@ checksubpage(struct pageref *pr)
 
 	for (; fl != NULL; fl = fl->next) {
 		fla = (vaddr_t)fl;
-		KASSERT(fla >= prpage && fla < prpage + PAGE_SIZE);
+		KASSERT(fla >= prpage && fla < prpage + SLAB_SIZE(blktype));
 		KASSERT((fla-prpage) % blocksize == 0);
 #ifdef CHECKBEEF
 		checkdeadbeef(fl, blocksize);
@@ -556,7 +644,7 @@ checksubpage(struct pageref *pr)
 	KASSERT(nfree==pr->nfree);
 
 #ifdef CHECKGUARDS
-	numblocks = PAGE_SIZE / blocksize;
+	numblocks = SLAB_NBLOCKS(blktype);
 	for (i=0; i<numblocks; i++) {
 		mask = 1U << (i % 32);
 		if ((isfree[i / 32] & mask) == 0) {
@@ -588,15 +676,20 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
+			KASSERT(pr->next_samesize == NULL ||
+				pr->next_samesize->prev_samesize == pr);
+			KASSERT(*pageref_slot(PR_PAGEADDR(pr)) == pr);
 			KASSERT(sc < TOTAL_PAGEREFS);
 			sc++;
 		}
 	}
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		checksubpage(pr);
-		KASSERT(ac < TOTAL_PAGEREFS);
-		ac++;
+	for (i=0; i<MAX_HEAP_FRAMES; i++) {
+		pr = pageref_byframe(i);
+		if (pr != NULL) {
+			checksubpage(pr);
+			ac++;
+		}
 	}
 
 	KASSERT(sc==ac);
@@ -640,7 +733,7 @@ void
 dump_subpage(struct pageref *pr, unsigned generation)
 {
 	unsigned blocksize = sizes[PR_BLOCKTYPE(pr)];
-	unsigned numblocks = PAGE_SIZE / blocksize;
+	unsigned numblocks = SLAB_NBLOCKS(PR_BLOCKTYPE(pr));
 	unsigned numfreewords = DIVROUNDUP(numblocks, 32);
 	uint32_t isfree[numfreewords], mask;
 	vaddr_t prpage;
@@ -739,6 +832,97 @@ kheap_dumpall(void)
 
 ////////////////////////////////////////
 
+/*
+ * Count a kmalloc of SZ bytes that got ALLOCSZ, in row ROW of the
+ * fragmentation report (the size class, or NSIZES for whole pages).
+ * Allocations made before the cpu structures exist are not counted.
+ */
+static
+void
+kmalloc_account(unsigned row, size_t sz, size_t allocsz)
+{
+	struct cpu *c;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return;
+	}
+	spl = splhigh();
+	c = curcpu->c_self;
+	c->c_kmalloc_nreq[row]++;
+	c->c_kmalloc_reqbytes[row] += sz;
+	c->c_kmalloc_allocbytes[row] += allocsz;
+	splx(spl);
+}
+
+/*
+ * Print, for each size class, the slabs and blocks in use now, and
+ * the bytes asked for against the bytes handed out since boot: the
+ * difference is the memory lost to rounding up to the class size.
+ * Blocks in magazines count as in use.
+ */
+static
+void
+kmalloc_fragstats(void)
+{
+	unsigned nslabs[NSIZES], nlive[NSIZES];
+	unsigned nreq;
+	uint64_t reqbytes, allocbytes;
+	uint64_t totreq = 0, totalloc = 0;
+	struct pageref *pr;
+	unsigned i, j, blktype;
+	struct cpu *c;
+
+	for (i=0; i<NSIZES; i++) {
+		nslabs[i] = nlive[i] = 0;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<MAX_HEAP_FRAMES; i++) {
+		pr = pageref_byframe(i);
+		if (pr != NULL) {
+			blktype = PR_BLOCKTYPE(pr);
+			nslabs[blktype]++;
+			nlive[blktype] += SLAB_NBLOCKS(blktype) - pr->nfree;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	kprintf("kmalloc size classes (requests since boot):\n");
+	kprintf("  size pages  slabs   live  requests   requested "
+		"  allocated  waste\n");
+	for (i=0; i<=NSIZES; i++) {
+		nreq = 0;
+		reqbytes = allocbytes = 0;
+		for (j=0; j<cpu_count(); j++) {
+			c = cpu_get(j);
+			nreq += c->c_kmalloc_nreq[i];
+			reqbytes += c->c_kmalloc_reqbytes[i];
+			allocbytes += c->c_kmalloc_allocbytes[i];
+		}
+		totreq += reqbytes;
+		totalloc += allocbytes;
+		if (i == NSIZES) {
+			kprintf("  page     -      -      - ");
+		}
+		else {
+			kprintf("  %4lu %5u %6u %6u ",
+				(unsigned long)sizes[i], slabpages[i],
+				nslabs[i], nlive[i]);
+		}
+		kprintf("%9u %11llu %11llu %5u%%\n", nreq,
+			(unsigned long long)reqbytes,
+			(unsigned long long)allocbytes,
+			allocbytes == 0 ? 0 :
+			(unsigned)((allocbytes - reqbytes) * 100 / allocbytes));
+	}
+	kprintf("  total %38llu %11llu %5u%%\n",
+		(unsigned long long)totreq,
+		(unsigned long long)totalloc,
+		totalloc == 0 ? 0 :
+		(unsigned)((totalloc - totreq) * 100 / totalloc));
+}
+
 /*
  * Print the allocated/freed map of a single kernel heap page.
  */
@@ -765,7 +949,7 @@ subpage_stats(struct pageref *pr)
 	KASSERT(blktype >= 0 && blktype < NSIZES);
 
 	/* compute how many bits we need in freemap and assert we fit */
-	n = PAGE_SIZE / sizes[blktype];
+	n = SLAB_NBLOCKS(blktype);
 	KASSERT(n <= 32 * ARRAYCOUNT(freemap));
 
 	if (pr->freelist_offset != INVALID_OFFSET) {
@@ -780,9 +964,10 @@ subpage_stats(struct pageref *pr)
 		}
 	}
 
-	kprintf("at 0x%08lx: size %-4lu  %u/%u free\n",
+	kprintf("at 0x%08lx: size %-4lu  %u/%u free%s\n",
 		(unsigned long)prpage, (unsigned long) sizes[blktype],
-		(unsigned) pr->nfree, n);
+		(unsigned) pr->nfree, n,
+		slabpages[blktype] > 1 ? "  (multi-page)" : "");
 	kprintf("   ");
 	for (i=0; i<n; i++) {
 		int val = (freemap[i/32] & (1<<(i%32)))!=0;
@@ -794,6 +979,10 @@ subpage_stats(struct pageref *pr)
 	kprintf("\n");
 }
 
+#ifdef MAGAZINES
+static void kmag_printstats(void);
+#endif
+
 /*
  * Print the whole heap.
  */
@@ -801,46 +990,63 @@ void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned i;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		subpage_stats(pr);
+	for (i=0; i<MAX_HEAP_FRAMES; i++) {
+		pr = pageref_byframe(i);
+		if (pr != NULL) {
+			subpage_stats(pr);
+		}
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kmalloc_fragstats();
+	kprintf("Live subpage blocks (not counting magazines): %u\n",
+		kheap_nlive());
+
+#ifdef MAGAZINES
+	/* blocks in magazines show as allocated above */
+	kmag_printstats();
+#endif
 }
 
 ////////////////////////////////////////
 
 /*
- * Remove a pageref from both lists that it's on.
+ * Remove a pageref from its list and from the page index.
  */
 static
 void
 remove_lists(struct pageref *pr, int blktype)
 {
-	struct pageref **guy;
+	struct pageref **slot;
+	unsigned i;
 
 	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	if (pr->prev_samesize != NULL) {
+		KASSERT(pr->prev_samesize->next_samesize == pr);
+		pr->prev_samesize->next_samesize = pr->next_samesize;
+	}
+	else {
+		KASSERT(sizebases[blktype] == pr);
+		sizebases[blktype] = pr->next_samesize;
+	}
+	if (pr->next_samesize != NULL) {
+		KASSERT(pr->next_samesize->prev_samesize == pr);
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
 	}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
-		}
+	for (i=0; i<slabpages[blktype]; i++) {
+		slot = pageref_slot(PR_PAGEADDR(pr) + i * PAGE_SIZE);
+		KASSERT(slot != NULL && *slot == pr);
+		*slot = NULL;
 	}
 }
 
@@ -880,6 +1086,7 @@ subpage_kmalloc(size_t sz
 {
 	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
+	struct pageref **slot;	// pagerefs_byframe entry for the page
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
@@ -921,7 +1128,7 @@ subpage_kmalloc(size_t sz
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
+			KASSERT(pr->freelist_offset < SLAB_SIZE(blktype));
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
 			fl = (struct freelist *)fla;
@@ -933,7 +1140,7 @@ subpage_kmalloc(size_t sz
 			if (fl != NULL) {
 				KASSERT(pr->nfree > 0);
 				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
+				KASSERT(fla - prpage < SLAB_SIZE(blktype));
 				pr->freelist_offset = fla - prpage;
 			}
 			else {
@@ -964,7 +1171,7 @@ subpage_kmalloc(size_t sz
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
-	prpage = alloc_kpages(1);
+	prpage = alloc_kpages(slabpages[blktype]);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
@@ -973,7 +1180,7 @@ subpage_kmalloc(size_t sz
 	KASSERT(prpage % PAGE_SIZE == 0);
 #ifdef CHECKBEEF
 	/* deadbeef the whole page, as it probably starts zeroed */
-	fill_deadbeef((void *)prpage, PAGE_SIZE);
+	fill_deadbeef((void *)prpage, SLAB_SIZE(blktype));
 #endif
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -987,7 +1194,7 @@ subpage_kmalloc(size_t sz
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pr->nfree = SLAB_NBLOCKS(blktype);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1008,10 +1215,17 @@ subpage_kmalloc(size_t sz
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
 	pr->next_samesize = sizebases[blktype];
+	pr->prev_samesize = NULL;
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr;
+	}
 	sizebases[blktype] = pr;
 
-	pr->next_all = allbase;
-	allbase = pr;
+	for (i=0; i<(int)slabpages[blktype]; i++) {
+		slot = pageref_slot(prpage + i * PAGE_SIZE);
+		KASSERT(slot != NULL && *slot == NULL);
+		*slot = pr;
+	}
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
@@ -1028,6 +1242,7 @@ subpage_kfree(void *ptr)
 	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
+	struct pageref **slot;	// pagerefs_byframe entry for the page
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
@@ -1061,38 +1276,35 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
+	slot = pageref_slot(ptraddr);
+	if (slot == NULL) {
+		/* Not even a kernel heap address */
+		return -1;
+	}
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = *slot;
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(ptraddr >= prpage && ptraddr < prpage + SLAB_SIZE(blktype));
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+	if (offset >= SLAB_SIZE(blktype) || offset % sizes[blktype] != 0) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
@@ -1137,8 +1349,8 @@ subpage_kfree(void *ptr)
 	pr->freelist_offset = offset;
 	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+	KASSERT(pr->nfree <= SLAB_NBLOCKS(blktype));
+	if (pr->nfree == SLAB_NBLOCKS(blktype)) {
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
@@ -1159,6 +1371,662 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    In front of the subpage allocator, each cpu keeps two magazines
+//    per small size class: little stacks of free blocks. kmalloc pops
+//    a block off the loaded magazine and kfree pushes it back, with
+//    interrupts off and no lock at all. When both of a cpu's
+//    magazines are empty (for kmalloc) or full (for kfree) it trades
+//    one with the depot, which keeps lists of full and empty
+//    magazines per size class under kmag_depot_lock. Only when the
+//    depot can't help either do we go to the pages and take
+//    kmalloc_spinlock.
+//
+//    Blocks in magazines are still allocated as far as their pages
+//    are concerned. To keep them from pinning too many pages, the
+//    depot holds at most KMAG_DEPOT_FULL full magazines per class;
+//    beyond that, magazines are emptied back into the pages.
+//
+//    Magazines are themselves subpage blocks, allocated (on the
+//    kmalloc side only: kfree never allocates) up to KMAG_MAX per
+//    size class and never freed.
+//
+//    GUARDS and LABELS set up every block as it is handed out, so
+//    magazines are not used with them.
+//
+//    kmag_free checks that a block is where a block can be in its
+//    page, but not that it is allocated (see the top of the file).
+//
+
+#ifdef MAGAZINES
+
+#define KMAG_ROUNDS 14		/* makes a magazine 64 bytes */
+#define KMAG_DEPOT_FULL 4
+#define KMAG_MAX (2 * cpu_count() + KMAG_DEPOT_FULL + 2)
+
+#if NSIZES < CPU_KMAG_CLASSES
+#define KMAG_CLASSES NSIZES
+#else
+#define KMAG_CLASSES CPU_KMAG_CLASSES
+#endif
+
+struct kmagazine {
+	struct kmagazine *next;		/* in the depot */
+	unsigned nrounds;
+	void *rounds[KMAG_ROUNDS];
+};
+
+struct kmag_depot {
+	struct kmagazine *full;
+	struct kmagazine *empty;
+	unsigned nfull, nempty;
+	unsigned nmagazines;		/* including those on the cpus */
+	unsigned gets;			/* full magazines handed to cpus */
+	unsigned puts;			/* full magazines taken from cpus */
+	unsigned drains;		/* full magazines emptied */
+};
+
+static struct spinlock kmag_depot_lock = SPINLOCK_INITIALIZER;
+static struct kmag_depot kmag_depots[KMAG_CLASSES];
+
+/*
+ * Get a block of type BLKTYPE from this cpu's magazines, or from a
+ * full magazine of the depot. Return NULL if there's none.
+ */
+static
+void *
+kmag_alloc(unsigned blktype)
+{
+	struct cpu *c;
+	struct kmag_depot *d;
+	struct kmagazine *m, *old;
+	void *ptr = NULL;
+	int spl;
+
+	if (blktype >= KMAG_CLASSES || !CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	m = c->c_kmag_loaded[blktype];
+	if (m == NULL || m->nrounds == 0) {
+		m = c->c_kmag_previous[blktype];
+		if (m != NULL && m->nrounds > 0) {
+			c->c_kmag_previous[blktype] =
+				c->c_kmag_loaded[blktype];
+			c->c_kmag_loaded[blktype] = m;
+		}
+		else {
+			/* trade the previous (empty) one for a full one */
+			d = &kmag_depots[blktype];
+			spinlock_acquire(&kmag_depot_lock);
+			m = d->full;
+			if (m != NULL) {
+				d->full = m->next;
+				d->nfull--;
+				d->gets++;
+				old = c->c_kmag_previous[blktype];
+				if (old != NULL) {
+					KASSERT(old->nrounds == 0);
+					old->next = d->empty;
+					d->empty = old;
+					d->nempty++;
+				}
+				c->c_kmag_previous[blktype] =
+					c->c_kmag_loaded[blktype];
+				c->c_kmag_loaded[blktype] = m;
+			}
+			spinlock_release(&kmag_depot_lock);
+		}
+	}
+	if (m != NULL) {
+		KASSERT(m->nrounds > 0);
+		ptr = m->rounds[--m->nrounds];
+		c->c_kmag_allochits++;
+	}
+	else {
+		c->c_kmag_allocmisses++;
+	}
+	splx(spl);
+	return ptr;
+}
+
+/*
+ * Put the rounds of the full magazine M back on their pages, and M on
+ * the depot's empty list.
+ */
+static
+void
+kmag_drain(struct kmagazine *m, unsigned blktype)
+{
+	struct kmag_depot *d = &kmag_depots[blktype];
+	unsigned i;
+	int result;
+
+	for (i=0; i<m->nrounds; i++) {
+		result = subpage_kfree(m->rounds[i]);
+		KASSERT(result == 0);
+	}
+	m->nrounds = 0;
+
+	spinlock_acquire(&kmag_depot_lock);
+	m->next = d->empty;
+	d->empty = m;
+	d->nempty++;
+	d->drains++;
+	spinlock_release(&kmag_depot_lock);
+}
+
+/*
+ * Make sure PTR, about to be freed, is not already in one of the
+ * magazines of C (interrupts off). Like the free list check of
+ * subpage_kfree, only the last block freed unless SLOW.
+ */
+static
+void
+kmag_checkfree(struct cpu *c, unsigned blktype, void *ptr)
+{
+	struct kmagazine *m;
+#ifdef SLOW
+	unsigned i;
+
+	m = c->c_kmag_loaded[blktype];
+	for (i = 0; m != NULL && i < m->nrounds; i++) {
+		KASSERT(m->rounds[i] != ptr);
+	}
+	m = c->c_kmag_previous[blktype];
+	for (i = 0; m != NULL && i < m->nrounds; i++) {
+		KASSERT(m->rounds[i] != ptr);
+	}
+#else
+	m = c->c_kmag_loaded[blktype];
+	if (m != NULL && m->nrounds > 0) {
+		KASSERT(m->rounds[m->nrounds - 1] != ptr);
+	}
+#endif
+}
+
+/*
+ * Put the block PTR in one of this cpu's magazines, trading a full
+ * one for an empty one of the depot if needed. Return false if PTR
+ * is not a small subpage block or no magazine has room for it.
+ */
+static
+bool
+kmag_free(void *ptr)
+{
+	struct pageref *const *slot;
+	struct pageref *pr;
+	struct cpu *c;
+	struct kmag_depot *d;
+	struct kmagazine *m, *old, *drain = NULL;
+	unsigned blktype;
+	vaddr_t offset;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+
+	/*
+	 * No lock needed: the pageref of a page with a block still
+	 * allocated on it doesn't change. And a page that is not a
+	 * heap page is not going to become one while its owner frees
+	 * it.
+	 */
+	slot = pageref_slot((vaddr_t)ptr);
+	if (slot == NULL || *slot == NULL) {
+		return false;
+	}
+	pr = *slot;
+	blktype = PR_BLOCKTYPE(pr);
+	if (blktype >= KMAG_CLASSES) {
+		return false;
+	}
+	/* Check for proper positioning and alignment, as subpage_kfree */
+	offset = (vaddr_t)ptr - PR_PAGEADDR(pr);
+	if (offset >= SLAB_SIZE(blktype) || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	kmag_checkfree(c, blktype, ptr);
+	m = c->c_kmag_loaded[blktype];
+	if (m == NULL || m->nrounds == KMAG_ROUNDS) {
+		m = c->c_kmag_previous[blktype];
+		if (m != NULL && m->nrounds < KMAG_ROUNDS) {
+			c->c_kmag_previous[blktype] =
+				c->c_kmag_loaded[blktype];
+			c->c_kmag_loaded[blktype] = m;
+		}
+		else {
+			/* trade the previous (full) one for an empty one */
+			d = &kmag_depots[blktype];
+			spinlock_acquire(&kmag_depot_lock);
+			m = d->empty;
+			if (m != NULL) {
+				d->empty = m->next;
+				d->nempty--;
+				old = c->c_kmag_previous[blktype];
+				if (old != NULL && d->nfull >= KMAG_DEPOT_FULL) {
+					drain = old;
+				}
+				else if (old != NULL) {
+					KASSERT(old->nrounds == KMAG_ROUNDS);
+					old->next = d->full;
+					d->full = old;
+					d->nfull++;
+					d->puts++;
+				}
+				c->c_kmag_previous[blktype] =
+					c->c_kmag_loaded[blktype];
+				c->c_kmag_loaded[blktype] = m;
+			}
+			spinlock_release(&kmag_depot_lock);
+		}
+	}
+	if (m != NULL) {
+		KASSERT(m->nrounds < KMAG_ROUNDS);
+		m->rounds[m->nrounds++] = ptr;
+		c->c_kmag_freehits++;
+	}
+	else {
+		c->c_kmag_freemisses++;
+	}
+	splx(spl);
+
+	if (drain != NULL) {
+		kmag_drain(drain, blktype);
+	}
+	return m != NULL;
+}
+
+/*
+ * Make sure the depot has an empty magazine of type BLKTYPE for kfree
+ * to trade, unless there are enough magazines around already.
+ */
+static
+void
+kmag_supply(unsigned blktype)
+{
+	struct kmag_depot *d;
+	struct kmagazine *m;
+	int result;
+
+	if (blktype >= KMAG_CLASSES || !CURCPU_EXISTS()) {
+		return;
+	}
+	d = &kmag_depots[blktype];
+	/* unlocked peek; rechecked below */
+	if (d->nempty > 0 || d->nmagazines >= KMAG_MAX) {
+		return;
+	}
+
+	m = subpage_kmalloc(sizeof(*m));
+	if (m == NULL) {
+		return;
+	}
+	m->nrounds = 0;
+
+	spinlock_acquire(&kmag_depot_lock);
+	if (d->nmagazines < KMAG_MAX) {
+		m->next = d->empty;
+		d->empty = m;
+		d->nempty++;
+		d->nmagazines++;
+		m = NULL;
+	}
+	spinlock_release(&kmag_depot_lock);
+
+	if (m != NULL) {
+		result = subpage_kfree(m);
+		KASSERT(result == 0);
+	}
+}
+
+/*
+ * Print the magazine hit rates and the depot.
+ */
+static
+void
+kmag_printstats(void)
+{
+	struct kmag_depot *d;
+	struct cpu *c;
+	unsigned i;
+
+	kprintf("Magazines: cpu, alloc hits, misses, free hits, misses\n");
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		kprintf("%3u: %8u %8u %8u %8u\n", c->c_number,
+			c->c_kmag_allochits, c->c_kmag_allocmisses,
+			c->c_kmag_freehits, c->c_kmag_freemisses);
+	}
+	kprintf("Depot: size, magazines, full, empty, gets, puts, drains\n");
+	spinlock_acquire(&kmag_depot_lock);
+	for (i=0; i<KMAG_CLASSES; i++) {
+		d = &kmag_depots[i];
+		kprintf("%4lu: %3u %3u %3u %8u %8u %8u\n",
+			(unsigned long)sizes[i], d->nmagazines, d->nfull,
+			d->nempty, d->gets, d->puts, d->drains);
+	}
+	spinlock_release(&kmag_depot_lock);
+}
+
+#endif /* MAGAZINES */
+
+/*
+ * Count the subpage blocks handed out by kmalloc and not given back:
+ * the allocated blocks of all slabs, less those waiting in magazines.
+ * Other cpus' magazines are looked at without stopping them, so the
+ * count is only exact while nothing else is allocating.
+ */
+unsigned
+kheap_nlive(void)
+{
+	struct pageref *pr;
+	unsigned i, nlive = 0, ncached = 0;
+#ifdef MAGAZINES
+	struct kmagazine *m;
+	struct cpu *c;
+	unsigned j;
+#endif
+
+	spinlock_acquire(&kmalloc_spinlock);
+	for (i=0; i<MAX_HEAP_FRAMES; i++) {
+		pr = pageref_byframe(i);
+		if (pr != NULL) {
+			nlive += SLAB_NBLOCKS(PR_BLOCKTYPE(pr)) - pr->nfree;
+		}
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+#ifdef MAGAZINES
+	spinlock_acquire(&kmag_depot_lock);
+	for (i=0; i<KMAG_CLASSES; i++) {
+		for (m = kmag_depots[i].full; m != NULL; m = m->next) {
+			ncached += m->nrounds;
+		}
+		for (j=0; j<cpu_count(); j++) {
+			c = cpu_get(j);
+			m = c->c_kmag_loaded[i];
+			if (m != NULL) {
+				ncached += m->nrounds;
+			}
+			m = c->c_kmag_previous[i];
+			if (m != NULL) {
+				ncached += m->nrounds;
+			}
+		}
+	}
+	spinlock_release(&kmag_depot_lock);
+#endif
+
+	return nlive > ncached ? nlive - ncached : 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Allocation profiler.
+//
+//    While it is on, every kmalloc is charged to its call site (the
+//    return address of kmalloc) and remembered until it is freed, so
+//    that for each site we know the allocations made, the blocks and
+//    bytes still live, and the most bytes live at once. Sites are
+//    printed by the live bytes they hold: a leak shows as a site
+//    whose live count keeps growing, a hot allocator as a site with
+//    many allocations and few live blocks. The addresses can be
+//    looked up with os161-addr2line.
+//
+//    Both tables are fixed-size arrays, so that the profiler never
+//    allocates: sites beyond KPROF_SITES and blocks beyond
+//    KPROF_BLOCKS are only counted as missed. Blocks allocated while
+//    the profiler is off are not tracked; frees of tracked blocks
+//    still are after it is turned off, so the live counts stay right.
+//
+//    When off, the cost is a flag test in kmalloc and kfree.
+//
+
+#define KPROF_SITES 128		/* power of 2 */
+#define KPROF_BLOCKS 1024
+#define KPROF_HASH 256		/* power of 2 */
+#define KPROF_NONE 0xffff
+
+struct kprof_site {
+	vaddr_t site;			/* 0 if unused */
+	unsigned nallocs;
+	unsigned nlive;
+	size_t livebytes;
+	size_t peakbytes;
+};
+
+struct kprof_block {
+	void *ptr;
+	size_t size;
+	uint16_t site;			/* index into kprof_sites */
+	uint16_t next;			/* hash chain or free list */
+};
+
+static struct spinlock kprof_lock = SPINLOCK_INITIALIZER;
+static volatile bool kprof_on;
+static volatile unsigned kprof_ntracked;	/* blocks in the table */
+static struct kprof_site kprof_sites[KPROF_SITES];
+static struct kprof_block kprof_blocks[KPROF_BLOCKS];
+static uint16_t kprof_hash[KPROF_HASH];
+static uint16_t kprof_freeblocks;
+static unsigned kprof_missed;		/* allocations not tracked */
+
+#define KPROF_PTRHASH(p) ((((vaddr_t)(p)) >> 3) & (KPROF_HASH - 1))
+#define KPROF_SITEHASH(s) ((((vaddr_t)(s)) >> 2) & (KPROF_SITES - 1))
+
+/*
+ * Empty both tables. Call with kprof_lock held.
+ */
+static
+void
+kprof_reset(void)
+{
+	unsigned i;
+
+	for (i=0; i<KPROF_SITES; i++) {
+		kprof_sites[i].site = 0;
+	}
+	for (i=0; i<KPROF_HASH; i++) {
+		kprof_hash[i] = KPROF_NONE;
+	}
+	for (i=0; i<KPROF_BLOCKS; i++) {
+		kprof_blocks[i].next = (i + 1 < KPROF_BLOCKS) ? i + 1 : KPROF_NONE;
+	}
+	kprof_freeblocks = 0;
+	kprof_ntracked = 0;
+	kprof_missed = 0;
+}
+
+/*
+ * Find or add the table entry of call site SITE. Returns KPROF_NONE
+ * if the table is full. Call with kprof_lock held.
+ */
+static
+unsigned
+kprof_findsite(vaddr_t site)
+{
+	struct kprof_site *ks;
+	unsigned i, n;
+
+	i = KPROF_SITEHASH(site);
+	for (n=0; n<KPROF_SITES; n++) {
+		ks = &kprof_sites[i];
+		if (ks->site == site) {
+			return i;
+		}
+		if (ks->site == 0) {
+			ks->site = site;
+			ks->nallocs = 0;
+			ks->nlive = 0;
+			ks->livebytes = 0;
+			ks->peakbytes = 0;
+			return i;
+		}
+		i = (i + 1) & (KPROF_SITES - 1);
+	}
+	return KPROF_NONE;
+}
+
+/*
+ * Charge the allocation of SZ bytes at PTR to call site SITE.
+ */
+static
+void
+kprof_alloc(void *ptr, size_t sz, vaddr_t site)
+{
+	struct kprof_site *ks;
+	struct kprof_block *kb;
+	unsigned s, b, h;
+
+	spinlock_acquire(&kprof_lock);
+	if (!kprof_on) {
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	s = kprof_findsite(site);
+	b = kprof_freeblocks;
+	if (s == KPROF_NONE || b == KPROF_NONE) {
+		kprof_missed++;
+		spinlock_release(&kprof_lock);
+		return;
+	}
+
+	kb = &kprof_blocks[b];
+	kprof_freeblocks = kb->next;
+	kb->ptr = ptr;
+	kb->size = sz;
+	kb->site = s;
+	h = KPROF_PTRHASH(ptr);
+	kb->next = kprof_hash[h];
+	kprof_hash[h] = b;
+	kprof_ntracked++;
+
+	ks = &kprof_sites[s];
+	ks->nallocs++;
+	ks->nlive++;
+	ks->livebytes += sz;
+	if (ks->livebytes > ks->peakbytes) {
+		ks->peakbytes = ks->livebytes;
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Forget PTR, if it is a tracked block, and uncharge its site.
+ */
+static
+void
+kprof_free(void *ptr)
+{
+	struct kprof_site *ks;
+	struct kprof_block *kb;
+	uint16_t *bp;
+
+	spinlock_acquire(&kprof_lock);
+	for (bp = &kprof_hash[KPROF_PTRHASH(ptr)]; *bp != KPROF_NONE;
+	     bp = &kb->next) {
+		kb = &kprof_blocks[*bp];
+		if (kb->ptr == ptr) {
+			ks = &kprof_sites[kb->site];
+			KASSERT(ks->nlive > 0 && ks->livebytes >= kb->size);
+			ks->nlive--;
+			ks->livebytes -= kb->size;
+
+			*bp = kb->next;
+			kb->next = kprof_freeblocks;
+			kprof_freeblocks = kb - kprof_blocks;
+			kprof_ntracked--;
+			break;
+		}
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Start profiling, from empty tables.
+ */
+void
+kheap_profile_start(void)
+{
+	spinlock_acquire(&kprof_lock);
+	kprof_reset();
+	kprof_on = true;
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Stop charging new allocations. What was gathered stays there to be
+ * printed.
+ */
+void
+kheap_profile_stop(void)
+{
+	spinlock_acquire(&kprof_lock);
+	kprof_on = false;
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Print the call sites, most live bytes first.
+ */
+void
+kheap_profile_print(void)
+{
+	uint8_t order[KPROF_SITES];
+	struct kprof_site *ks;
+	unsigned i, j, n = 0, tmp;
+	unsigned totallocs = 0, totlive = 0;
+	size_t totbytes = 0;
+
+	spinlock_acquire(&kprof_lock);
+
+	/* insertion sort of the used entries, by live bytes */
+	for (i=0; i<KPROF_SITES; i++) {
+		if (kprof_sites[i].site == 0) {
+			continue;
+		}
+		order[n] = i;
+		for (j=n; j>0; j--) {
+			if (kprof_sites[order[j-1]].livebytes >=
+			    kprof_sites[order[j]].livebytes) {
+				break;
+			}
+			tmp = order[j];
+			order[j] = order[j-1];
+			order[j-1] = tmp;
+		}
+		n++;
+	}
+
+	kprintf("Kernel heap profile (%s): %u sites, %u allocations "
+		"not tracked\n", kprof_on ? "on" : "off", n, kprof_missed);
+	kprintf("  call site    allocs     live  live bytes  peak bytes\n");
+	for (i=0; i<n; i++) {
+		ks = &kprof_sites[order[i]];
+		kprintf("  0x%08lx %8u %8u %11lu %11lu\n",
+			(unsigned long)ks->site, ks->nallocs, ks->nlive,
+			(unsigned long)ks->livebytes,
+			(unsigned long)ks->peakbytes);
+		totallocs += ks->nallocs;
+		totlive += ks->nlive;
+		totbytes += ks->livebytes;
+	}
+	kprintf("  total      %8u %8u %11lu\n", totallocs, totlive,
+		(unsigned long)totbytes);
+
+	spinlock_release(&kprof_lock);
+}
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -1170,20 +2038,19 @@ void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
-#ifdef LABELS
+	unsigned blktype;
+	void *ptr;
 	vaddr_t label;
-#endif
 
-#ifdef LABELS
+	/* the call site, for LABELS and for the profiler */
 #ifdef __GNUC__
 	label = (vaddr_t)__builtin_return_address(0);
 #else
 #error "Don't know how to get return address with this compiler"
 #endif /* __GNUC__ */
-#endif /* LABELS */
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
-	if (checksz >= LARGEST_SUBPAGE_SIZE) {
+	if (checksz > LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
 
@@ -1194,15 +2061,41 @@ kmalloc(size_t sz)
 			return NULL;
 		}
 		KASSERT(address % PAGE_SIZE == 0);
+		kmalloc_account(NSIZES, sz, npages * PAGE_SIZE);
+		if (kprof_on) {
+			kprof_alloc((void *)address, sz, label);
+		}
 
 		return (void *)address;
 	}
 
+	blktype = blocktype(checksz);
+
+#ifdef MAGAZINES
+	ptr = kmag_alloc(blktype);
+	if (ptr != NULL) {
+		kmalloc_account(blktype, sz, sizes[blktype]);
+		if (kprof_on) {
+			kprof_alloc(ptr, sz, label);
+		}
+		return ptr;
+	}
+	/* give the kfree side a magazine to fill */
+	kmag_supply(blktype);
+#endif
+
 #ifdef LABELS
-	return subpage_kmalloc(sz, label);
+	ptr = subpage_kmalloc(sz, label);
 #else
-	return subpage_kmalloc(sz);
+	ptr = subpage_kmalloc(sz);
 #endif
+	if (ptr != NULL) {
+		kmalloc_account(blktype, sz, sizes[blktype]);
+		if (kprof_on) {
+			kprof_alloc(ptr, sz, label);
+		}
+	}
+	return ptr;
 }
 
 /*
@@ -1216,7 +2109,16 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+	if (kprof_ntracked > 0) {
+		kprof_free(ptr);
+	}
+#ifdef MAGAZINES
+	if (kmag_free(ptr)) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
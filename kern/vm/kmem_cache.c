@@ -0,0 +1,437 @@
+/*
+ * Object caches (see kmem_cache.h).
+ *
+ * A slab is one page: the objects from the start of the page, each
+ * followed by a link word, and a struct kmem_slab at the end. The link
+ * word chains the free objects of the slab without touching their
+ * constructed contents; the slab of an object is found from its page
+ * address alone.
+ *
+ *   | obj | link | pad | obj | link | pad | ... |      | kmem_slab |
+ *   <----- stride ----->
+ *
+ * Each cache keeps its slabs on three lists: partial (the ones objects
+ * are allocated from), full and empty. At most KMEM_EMPTY_MAX empty
+ * slabs are kept; more are destroyed, running the destructor on their
+ * objects. Objects for which fewer than KMEM_MIN_PERSLAB would fit in
+ * a slab are "large" and come from kmalloc one by one; up to
+ * KMEM_LARGE_MAX free ones are kept constructed.
+ *
+ * All of a cache is protected by its kc_lock; the list of caches by
+ * kmem_caches_lock, taken before any kc_lock.
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+#define KMEM_DEFAULT_ALIGN 8
+#define KMEM_MIN_PERSLAB 8
+#define KMEM_EMPTY_MAX 1
+
+struct kmem_slab
+{
+	struct kmem_slab *ks_next;
+	struct kmem_slab *ks_prev;
+	void *ks_free;	  /* first free object */
+	unsigned ks_nfree;
+};
+
+#define SLAB_OF(obj) \
+	((struct kmem_slab *)(((vaddr_t)(obj) & PAGE_FRAME) + PAGE_SIZE - sizeof(struct kmem_slab)))
+#define SLAB_PAGE(ks) ((vaddr_t)(ks) & PAGE_FRAME)
+
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches = NULL;
+
+/* Address of the free-list link of OBJ */
+static void **obj_link(struct kmem_cache *kc, void *obj)
+{
+	return (void **)((vaddr_t)obj + ROUNDUP(kc->kc_size, sizeof(void *)));
+}
+
+static void slab_insert(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *list;
+	if (ks->ks_next != NULL)
+	{
+		ks->ks_next->ks_prev = ks;
+	}
+	*list = ks;
+}
+
+static void slab_remove(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	if (ks->ks_prev != NULL)
+	{
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else
+	{
+		KASSERT(*list == ks);
+		*list = ks->ks_next;
+	}
+	if (ks->ks_next != NULL)
+	{
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+}
+
+/* Compute the layout of KC and put it on the list, at first use */
+static void kmem_cache_setup(struct kmem_cache *kc)
+{
+	bool first = false;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (!kc->kc_ready)
+	{
+		if (kc->kc_align == 0)
+		{
+			kc->kc_align = KMEM_DEFAULT_ALIGN;
+		}
+		KASSERT((kc->kc_align & (kc->kc_align - 1)) == 0);
+		KASSERT(kc->kc_size > 0);
+		kc->kc_stride = ROUNDUP(ROUNDUP(kc->kc_size, sizeof(void *)) + sizeof(void *),
+								kc->kc_align);
+		kc->kc_perslab = (PAGE_SIZE - sizeof(struct kmem_slab)) / kc->kc_stride;
+		if (kc->kc_perslab < KMEM_MIN_PERSLAB)
+		{
+			/* large: kmalloc aligns to the block size */
+			KASSERT(kc->kc_align <= PAGE_SIZE);
+			kc->kc_perslab = 0;
+		}
+		kc->kc_ready = true;
+		first = true;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (first)
+	{
+		spinlock_acquire(&kmem_caches_lock);
+		kc->kc_next = kmem_caches;
+		kmem_caches = kc;
+		spinlock_release(&kmem_caches_lock);
+	}
+}
+
+/* Make a slab of constructed objects for KC, or return NULL */
+static struct kmem_slab *slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+	void *obj;
+	unsigned i, j;
+
+	page = alloc_kpages(1);
+	if (page == 0)
+	{
+		return NULL;
+	}
+	ks = SLAB_OF(page);
+	ks->ks_free = NULL;
+	ks->ks_nfree = kc->kc_perslab;
+
+	/* chain them up in address order */
+	for (i = kc->kc_perslab; i-- > 0;)
+	{
+		obj = (void *)(page + i * kc->kc_stride);
+		if (kc->kc_ctor != NULL && kc->kc_ctor(obj) != 0)
+		{
+			for (j = i + 1; j < kc->kc_perslab; j++)
+			{
+				if (kc->kc_dtor != NULL)
+					kc->kc_dtor((void *)(page + j * kc->kc_stride));
+			}
+			free_kpages(page);
+			return NULL;
+		}
+		*obj_link(kc, obj) = ks->ks_free;
+		ks->ks_free = obj;
+	}
+	return ks;
+}
+
+/* Destroy the slab KS of KC, all of whose objects are free */
+static void slab_destroy(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	unsigned i;
+
+	KASSERT(ks->ks_nfree == kc->kc_perslab);
+	if (kc->kc_dtor != NULL)
+	{
+		for (i = 0; i < kc->kc_perslab; i++)
+		{
+			kc->kc_dtor((void *)(SLAB_PAGE(ks) + i * kc->kc_stride));
+		}
+	}
+	free_kpages(SLAB_PAGE(ks));
+}
+
+static void *large_alloc(struct kmem_cache *kc)
+{
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_nlarge > 0)
+	{
+		obj = kc->kc_large[--kc->kc_nlarge];
+		goto done;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL)
+	{
+		return NULL;
+	}
+	KASSERT((vaddr_t)obj % kc->kc_align == 0);
+	if (kc->kc_ctor != NULL && kc->kc_ctor(obj) != 0)
+	{
+		kfree(obj);
+		return NULL;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_total++;
+	if (kc->kc_ctor != NULL)
+	{
+		kc->kc_ctors++;
+	}
+done:
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	if (kc->kc_inuse > kc->kc_peak)
+	{
+		kc->kc_peak = kc->kc_inuse;
+	}
+	spinlock_release(&kc->kc_lock);
+	return obj;
+}
+
+static void large_free(struct kmem_cache *kc, void *obj)
+{
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_inuse--;
+	if (kc->kc_nlarge < KMEM_LARGE_MAX)
+	{
+		kc->kc_large[kc->kc_nlarge++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	kc->kc_total--;
+	spinlock_release(&kc->kc_lock);
+
+	if (kc->kc_dtor != NULL)
+	{
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	void *obj;
+
+	if (!kc->kc_ready)
+	{
+		kmem_cache_setup(kc);
+	}
+	if (kc->kc_perslab == 0)
+	{
+		return large_alloc(kc);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	ks = kc->kc_partial;
+	if (ks == NULL && kc->kc_empty != NULL)
+	{
+		ks = kc->kc_empty;
+		slab_remove(&kc->kc_empty, ks);
+		kc->kc_nempty--;
+		slab_insert(&kc->kc_partial, ks);
+	}
+	if (ks == NULL)
+	{
+		/* can't allocate or run constructors under the spinlock */
+		spinlock_release(&kc->kc_lock);
+		ks = slab_create(kc);
+		if (ks == NULL)
+		{
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		slab_insert(&kc->kc_partial, ks);
+		kc->kc_nslabs++;
+		kc->kc_total += kc->kc_perslab;
+		if (kc->kc_ctor != NULL)
+		{
+			kc->kc_ctors += kc->kc_perslab;
+		}
+	}
+
+	KASSERT(ks->ks_nfree > 0);
+	obj = ks->ks_free;
+	ks->ks_free = *obj_link(kc, obj);
+	ks->ks_nfree--;
+	if (ks->ks_nfree == 0)
+	{
+		slab_remove(&kc->kc_partial, ks);
+		slab_insert(&kc->kc_full, ks);
+	}
+
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	if (kc->kc_inuse > kc->kc_peak)
+	{
+		kc->kc_peak = kc->kc_inuse;
+	}
+	spinlock_release(&kc->kc_lock);
+	return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks, *victim = NULL;
+	vaddr_t offset;
+
+	KASSERT(obj != NULL);
+	KASSERT(kc->kc_ready);
+	if (kc->kc_perslab == 0)
+	{
+		large_free(kc, obj);
+		return;
+	}
+
+	ks = SLAB_OF(obj);
+	offset = (vaddr_t)obj - SLAB_PAGE(ks);
+	if (offset % kc->kc_stride != 0 ||
+		offset / kc->kc_stride >= kc->kc_perslab)
+	{
+		panic("kmem_cache_free: %s: invalid object %p\n", kc->kc_name, obj);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(ks->ks_nfree < kc->kc_perslab);
+	if (ks->ks_nfree == 0)
+	{
+		slab_remove(&kc->kc_full, ks);
+		slab_insert(&kc->kc_partial, ks);
+	}
+	*obj_link(kc, obj) = ks->ks_free;
+	ks->ks_free = obj;
+	ks->ks_nfree++;
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_inuse--;
+
+	if (ks->ks_nfree == kc->kc_perslab)
+	{
+		slab_remove(&kc->kc_partial, ks);
+		if (kc->kc_nempty < KMEM_EMPTY_MAX)
+		{
+			slab_insert(&kc->kc_empty, ks);
+			kc->kc_nempty++;
+		}
+		else
+		{
+			victim = ks;
+			kc->kc_nslabs--;
+			kc->kc_total -= kc->kc_perslab;
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (victim != NULL)
+	{
+		slab_destroy(kc, victim);
+	}
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+									 size_t align, int (*ctor)(void *),
+									 void (*dtor)(void *))
+{
+	struct kmem_cache *kc;
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL)
+	{
+		return NULL;
+	}
+	bzero(kc, sizeof(*kc));
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_align = align;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kmem_cache_setup(kc);
+	return kc;
+}
+
+void kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+	struct kmem_slab *ks;
+
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_partial == NULL && kc->kc_full == NULL);
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (p = &kmem_caches; *p != kc; p = &(*p)->kc_next)
+	{
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	while ((ks = kc->kc_empty) != NULL)
+	{
+		slab_remove(&kc->kc_empty, ks);
+		slab_destroy(kc, ks);
+	}
+	while (kc->kc_nlarge > 0)
+	{
+		if (kc->kc_dtor != NULL)
+		{
+			kc->kc_dtor(kc->kc_large[kc->kc_nlarge - 1]);
+		}
+		kfree(kc->kc_large[--kc->kc_nlarge]);
+	}
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+	unsigned long bytes;
+
+	kprintf("Object caches:\n");
+	kprintf("%-12s %5s %6s %6s %6s %5s %8s %8s %8s\n", "name", "size",
+			"stride", "inuse", "peak", "slabs", "bytes", "allocs", "ctors");
+	spinlock_acquire(&kmem_caches_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next)
+	{
+		spinlock_acquire(&kc->kc_lock);
+		if (kc->kc_perslab > 0)
+		{
+			bytes = (unsigned long)kc->kc_nslabs * PAGE_SIZE;
+		}
+		else
+		{
+			/* large: one kmalloc block each */
+			bytes = (unsigned long)kc->kc_total * kc->kc_size;
+		}
+		kprintf("%-12s %5lu %6lu %6u %6u %5u %8lu %8u %8u\n", kc->kc_name,
+				(unsigned long)kc->kc_size,
+				(unsigned long)(kc->kc_perslab > 0 ? kc->kc_stride : kc->kc_size),
+				kc->kc_inuse, kc->kc_peak, kc->kc_nslabs, bytes,
+				kc->kc_allocs, kc->kc_ctors);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_caches_lock);
+}
@@ -0,0 +1,161 @@
+/*
+ * Two-level page table (see pt.h).
+ *
+ * Frames of user pages come from alloc_kpages(1) and go back with
+ * free_kpages, so they share the per-cpu page caches with the kernel.
+ * Every valid PTE holds a reference to its frame in the coremap; the
+ * frame is freed when the last page table mapping it lets it go.
+ *
+ * No locking: a page table belongs to one single-threaded process,
+ * only its own thread (or whoever destroys it after exit) touches it.
+ * With options swap the evicting thread changes page tables too, and
+ * all users of the page tables are serialized by dumbvm's vm_lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pt.h>
+#include "opt-swap.h"
+#if OPT_SWAP
+#include <swapfile.h>
+#endif
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL)
+	{
+		return NULL;
+	}
+	bzero(pt, sizeof(struct pagetable));
+	return pt;
+}
+
+void pt_destroy(struct pagetable *pt)
+{
+	unsigned i, j;
+	pte_t *l2;
+
+	KASSERT(pt != NULL);
+	for (i = 0; i < PT_ENTRIES; i++)
+	{
+		l2 = pt->pt_l2[i];
+		if (l2 == NULL)
+			continue;
+		for (j = 0; j < PT_ENTRIES; j++)
+		{
+			if ((l2[j] & PTE_VALID) &&
+				coremap_decref(l2[j] & PTE_FRAME) == 0)
+			{
+				free_kpages(PADDR_TO_KVADDR(l2[j] & PTE_FRAME));
+			}
+#if OPT_SWAP
+			else if (l2[j] & PTE_SWAPPED)
+			{
+				swap_free(PTE_SLOT(l2[j]));
+			}
+#endif
+		}
+		kfree(l2);
+	}
+	kfree(pt);
+}
+
+pte_t *pt_get(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t **l2;
+
+	KASSERT(pt != NULL);
+	l2 = &pt->pt_l2[PT_L1_INDEX(vaddr)];
+	if (*l2 == NULL)
+	{
+		if (!create)
+			return NULL;
+		*l2 = kmalloc(PT_ENTRIES * sizeof(pte_t));
+		if (*l2 == NULL)
+			return NULL;
+		bzero(*l2, PT_ENTRIES * sizeof(pte_t));
+	}
+	return &(*l2)[PT_L2_INDEX(vaddr)];
+}
+
+int pt_copy(struct pagetable *old, struct pagetable **ret, unsigned *nshared)
+{
+	struct pagetable *new;
+	unsigned i, j;
+	pte_t *l2, *newl2;
+#if OPT_SWAP
+	unsigned slot;
+	int result;
+#endif
+
+	new = pt_create();
+	if (new == NULL)
+	{
+		return ENOMEM;
+	}
+	for (i = 0; i < PT_ENTRIES; i++)
+	{
+		l2 = old->pt_l2[i];
+		if (l2 == NULL)
+			continue;
+		newl2 = kmalloc(PT_ENTRIES * sizeof(pte_t));
+		if (newl2 == NULL)
+		{
+			pt_destroy(new);
+			return ENOMEM;
+		}
+		bzero(newl2, PT_ENTRIES * sizeof(pte_t));
+		new->pt_l2[i] = newl2;
+		for (j = 0; j < PT_ENTRIES; j++)
+		{
+#if OPT_SWAP
+			if (l2[j] & PTE_SWAPPED)
+			{
+				result = swap_dup(PTE_SLOT(l2[j]), &slot);
+				if (result)
+				{
+					pt_destroy(new);
+					return result;
+				}
+				newl2[j] = PTE_MKSWAPPED(slot);
+				continue;
+			}
+#endif
+			if ((l2[j] & PTE_VALID) == 0)
+				continue;
+			/* the parent loses write access too: see vm_fault */
+			l2[j] |= PTE_COW;
+			newl2[j] = l2[j];
+			coremap_incref(l2[j] & PTE_FRAME);
+			(*nshared)++;
+		}
+	}
+	*ret = new;
+	return 0;
+}
+
+unsigned pt_resident(struct pagetable *pt)
+{
+	unsigned i, j, n = 0;
+	pte_t *l2;
+
+	for (i = 0; i < PT_ENTRIES; i++)
+	{
+		l2 = pt->pt_l2[i];
+		if (l2 == NULL)
+			continue;
+		for (j = 0; j < PT_ENTRIES; j++)
+		{
+			if (l2[j] & PTE_VALID)
+				n++;
+		}
+	}
+	return n;
+}
@@ -0,0 +1,182 @@
+/*
+ * Swap space (see swapfile.h).
+ *
+ * Slots are allocated from a bitmap protected by swap_lock; the I/O
+ * itself is done without holding it, straight from and to the frame
+ * through its kseg0 address.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swapfile.h>
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct vnode *swapVnode = NULL;
+static struct bitmap *swapMap = NULL;
+static unsigned swapSlots = 0;
+
+/* Protected by swap_lock */
+static unsigned swapUsed = 0;
+static unsigned long swapOuts = 0;
+static unsigned long swapIns = 0;
+
+void swap_bootstrap(void)
+{
+	struct stat st;
+	struct vnode *vn;
+	int result;
+
+	result = vfs_swapon(SWAP_DEVICE, &vn);
+	if (result)
+	{
+		kprintf("swap: cannot use %s: %s, running without swap\n",
+				SWAP_DEVICE, strerror(result));
+		return;
+	}
+	result = VOP_STAT(vn, &st);
+	if (result || st.st_size < PAGE_SIZE)
+	{
+		kprintf("swap: %s has no usable size, running without swap\n",
+				SWAP_DEVICE);
+		VOP_DECREF(vn);
+		vfs_swapoff(SWAP_DEVICE);
+		return;
+	}
+	swapMap = bitmap_create(st.st_size / PAGE_SIZE);
+	if (swapMap == NULL)
+	{
+		panic("swap_bootstrap: out of memory\n");
+	}
+	swapSlots = st.st_size / PAGE_SIZE;
+	swapVnode = vn;
+	kprintf("swap: %u pages on %s\n", swapSlots, SWAP_DEVICE);
+}
+
+bool swap_enabled(void)
+{
+	return swapVnode != NULL;
+}
+
+static int swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	KASSERT(slot < swapSlots);
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+			  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ)
+	{
+		return VOP_READ(swapVnode, &ku);
+	}
+	return VOP_WRITE(swapVnode, &ku);
+}
+
+static int swap_alloc(unsigned *slot)
+{
+	int result;
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swapMap, slot);
+	if (result == 0)
+	{
+		swapUsed++;
+	}
+	spinlock_release(&swap_lock);
+	return result;
+}
+
+void swap_free(unsigned slot)
+{
+	KASSERT(slot < swapSlots);
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swapMap, slot));
+	bitmap_unmark(swapMap, slot);
+	swapUsed--;
+	spinlock_release(&swap_lock);
+}
+
+int swap_out(paddr_t paddr, unsigned *slot)
+{
+	int result;
+
+	KASSERT(swap_enabled());
+	result = swap_alloc(slot);
+	if (result)
+	{
+		return result;
+	}
+	result = swap_io(*slot, paddr, UIO_WRITE);
+	if (result)
+	{
+		swap_free(*slot);
+		return result;
+	}
+	spinlock_acquire(&swap_lock);
+	swapOuts++;
+	spinlock_release(&swap_lock);
+	return 0;
+}
+
+int swap_in(unsigned slot, paddr_t paddr)
+{
+	int result;
+
+	KASSERT(swap_enabled());
+	result = swap_io(slot, paddr, UIO_READ);
+	if (result)
+	{
+		return result;
+	}
+	spinlock_acquire(&swap_lock);
+	swapIns++;
+	spinlock_release(&swap_lock);
+	return 0;
+}
+
+int swap_dup(unsigned slot, unsigned *newslot)
+{
+	void *buf;
+	int result;
+
+	buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL)
+	{
+		return ENOMEM;
+	}
+	/* kmalloc(PAGE_SIZE) is a whole page, so it has a paddr */
+	result = swap_in(slot, KVADDR_TO_PADDR((vaddr_t)buf));
+	if (result == 0)
+	{
+		result = swap_out(KVADDR_TO_PADDR((vaddr_t)buf), newslot);
+	}
+	kfree(buf);
+	return result;
+}
+
+void swap_printstats(void)
+{
+	unsigned used;
+	unsigned long outs, ins;
+
+	if (!swap_enabled())
+	{
+		kprintf("Swap: disabled\n");
+		return;
+	}
+	spinlock_acquire(&swap_lock);
+	used = swapUsed;
+	outs = swapOuts;
+	ins = swapIns;
+	spinlock_release(&swap_lock);
+	kprintf("Swap: %u/%u slots used, %lu pages out, %lu pages in\n",
+			used, swapSlots, outs, ins);
+}